@@ -1,3 +1,6 @@
+#ifndef EPT_H
+#define EPT_H
+
 // See Table 28-6
 typedef union _EPT_PTE {
     uint64_t All;
@@ -37,6 +40,50 @@ typedef union _EPT_PDE {
     }Fields;
 }EPT_PML2_ENTRY, *PEPT_PDE;
 
+// See Table 28-4
+typedef union _EPT_PDE_2MB {
+    uint64_t All;
+    struct {
+        uint64_t Read : 1; // bit 0
+        uint64_t Write : 1; // bit 1
+        uint64_t Execute : 1; // bit 2
+        uint64_t EPTMemoryType : 3; // bit 5:3 (EPT Memory type)
+        uint64_t IgnorePAT : 1; // bit 6
+        uint64_t LargePage : 1; // bit 7 (Must be 1, otherwise this entry references an EPT page table)
+        uint64_t AccessedFlag : 1; // bit 8
+        uint64_t DirtyFlag : 1; // bit 9
+        uint64_t ExecuteForUserMode : 1; // bit 10
+        uint64_t Ignored1 : 1; // bit 11
+        uint64_t Reserved1 : 9; // bit 20:12 (Must be Zero)
+        uint64_t PhysicalAddress : 27; // bit (N-1):21 or 2MB-Page-Frame-Number
+        uint64_t Reserved2 : 4; // bit 51:N
+        uint64_t Ignored2 : 11; // bit 62:52
+        uint64_t SuppressVE : 1; // bit 63
+    }Fields;
+}EPT_PML2_2MB_ENTRY, *PEPT_PDE_2MB;
+
+// See Table 28-2
+typedef union _EPT_PDPTE_1GB {
+    uint64_t All;
+    struct {
+        uint64_t Read : 1; // bit 0
+        uint64_t Write : 1; // bit 1
+        uint64_t Execute : 1; // bit 2
+        uint64_t EPTMemoryType : 3; // bit 5:3 (EPT Memory type)
+        uint64_t IgnorePAT : 1; // bit 6
+        uint64_t LargePage : 1; // bit 7 (Must be 1, otherwise this entry references an EPT page directory)
+        uint64_t AccessedFlag : 1; // bit 8
+        uint64_t DirtyFlag : 1; // bit 9
+        uint64_t ExecuteForUserMode : 1; // bit 10
+        uint64_t Ignored1 : 1; // bit 11
+        uint64_t Reserved1 : 18; // bit 29:12 (Must be Zero)
+        uint64_t PhysicalAddress : 18; // bit (N-1):30 or 1GB-Page-Frame-Number
+        uint64_t Reserved2 : 4; // bit 51:N
+        uint64_t Ignored2 : 11; // bit 62:52
+        uint64_t SuppressVE : 1; // bit 63
+    }Fields;
+}EPT_PML3_1GB_ENTRY, *PEPT_PDPTE_1GB;
+
 // See Table 28-3
 typedef union _EPT_PDPTE {
     uint64_t All;
@@ -86,4 +133,13 @@ typedef union _EPTP {
     }Fields;
 }EPTP, *PEPTP;
 
+#define EPT_PAGE_SIZE_4K  0x1000ULL
+#define EPT_PAGE_SIZE_2MB 0x200000ULL
+#define EPT_PAGE_SIZE_1GB 0x40000000ULL
+
+#define EPT_PML4_INDEX(gpa) (((gpa) >> 39) & 0x1ff)
+#define EPT_PML3_INDEX(gpa) (((gpa) >> 30) & 0x1ff)
+#define EPT_PML2_INDEX(gpa) (((gpa) >> 21) & 0x1ff)
+#define EPT_PML1_INDEX(gpa) (((gpa) >> 12) & 0x1ff)
 
+#endif
@@ -1,4 +1,26 @@
 #define MYPAGE_SIZE 4096
+#define GUEST_ENTRY_RIP 0
+#define GUEST_ENTRY_RSP 0x1000
+// guest page tables built by setup_guest_page_tables(), guest CR3
+#define GUEST_PAGE_TABLES 0x10000
+#define GUEST_PAGE_TABLES_END 0x20000
+#define GUEST_PAGE_SIZE_2MB (1ULL << 21)
+#define GUEST_PAGE_SIZE_1GB (1ULL << 30)
+// room for PML4, PDPT, PD and the PT of a tail below 2MB
+#define GUEST_MIN_MEM_SIZE 0x14000
+#define GUEST_MAX_MEM_SIZE (1ULL << 39)
+// guest memory is allocated and mapped in 2MB chunks
+#define GUEST_CHUNK_ORDER 9
+#define GUEST_CHUNK_SIZE (4096ULL << GUEST_CHUNK_ORDER)
+// page pools, see pool_alloc()
+#define POOL_PAGE  0
+#define POOL_CHUNK 1
+#define POOL_KINDS 2
+// shared images, see create_shared_image(); one bit of a VM's
+// shared_windows per 1GB
+#define SHARED_IMAGE_MAX_SIZE (64ULL << 30)
+// guest console lines printed per drain_console() call
+#define CONSOLE_DRAIN_LINES 64
 #define X86_CR4_VMXE_BIT	13 /* enable VMX virtualization */
 #define X86_CR4_VMXE		_BITUL(X86_CR4_VMXE_BIT)
 #define FEATURE_CONTROL_VMXON_ENABLED_OUTSIDE_SMX	(1<<2)
@@ -12,6 +34,31 @@
 #define MSR_IA32_VMX_PROCBASED_CTLS2	0x0000048b
 #define MSR_IA32_VMX_EXIT_CTLS			0x00000483
 #define MSR_IA32_VMX_ENTRY_CTLS			0x00000484
+#define MSR_IA32_VMX_EPT_VPID_CAP		0x0000048c
+// CH A.10, Vol 3
+#define VMX_EPT_2MB_PAGE_BIT			(1ULL<<16)
+#define VMX_EPT_1GB_PAGE_BIT			(1ULL<<17)
+#define VMX_EPT_INVEPT_BIT				(1ULL<<20)
+#define VMX_EPT_AD_BIT					(1ULL<<21)
+#define VMX_EPT_INVEPT_SINGLE_BIT		(1ULL<<25)
+#define VMX_EPT_INVEPT_ALL_BIT			(1ULL<<26)
+#define VMX_VPID_INVVPID_BIT			(1ULL<<32)
+#define VMX_VPID_INVVPID_SINGLE_BIT		(1ULL<<41)
+#define VMX_VPID_INVVPID_ALL_BIT		(1ULL<<42)
+// CH 30.3, Vol 3, INVEPT and INVVPID types
+#define INVEPT_SINGLE_CONTEXT			1
+#define INVEPT_ALL_CONTEXT				2
+#define INVVPID_SINGLE_CONTEXT			1
+#define INVVPID_ALL_CONTEXT				2
+// CH 24.6.9, Vol 3: the MSR bitmap covers these two ranges, read bitmaps
+// first, then write bitmaps
+#define MSR_BITMAP_LOW_BASE				0x00000000
+#define MSR_BITMAP_HIGH_BASE			0xc0000000
+#define MSR_BITMAP_RANGE				0x2000
+// VPID 0 is the host's
+#define VMX_NR_VPIDS					(1 << 16)
+#define EPT_MEMORY_TYPE_UC				0
+#define EPT_MEMORY_TYPE_WB				6
 // CH B.3.1
 // Table B-8. Encodings for 32-Bit Control Fields
 #define PIN_BASED_VM_EXEC_CONTROLS		0x00004000
@@ -20,6 +67,27 @@
 #define VM_EXIT_CONTROLS				0x0000400c
 #define VM_ENTRY_CONTROLS				0x00004012
 #define CPU_BASED_ACTIVATE_SECONDARY_CONTROLS	0x80000000
+// CH 24.6.1, Vol 3
+#define PIN_BASED_EXT_INTR_MASK			0x00000001
+#define PIN_BASED_NMI_EXITING			0x00000008
+#define PIN_BASED_VMX_PREEMPTION_TIMER	0x00000040
+// CH A.6, Vol 3: the preemption timer counts down once every
+// 2^(IA32_VMX_MISC[4:0]) TSC ticks
+#define MSR_IA32_VMX_MISC				0x00000485
+#define VMX_MISC_PREEMPTION_TIMER_RATE_MASK	0x1f
+// CH 24.6.2, Vol 3
+#define CPU_BASED_HLT_EXITING			0x00000080
+#define CPU_BASED_UNCOND_IO_EXITING		0x01000000
+#define CPU_BASED_USE_IO_BITMAPS		0x02000000
+#define CPU_BASED_USE_MSR_BITMAPS		0x10000000
+#define SECONDARY_EXEC_ENABLE_VPID		0x00000020
+#define SECONDARY_EXEC_ENABLE_PML		0x00020000
+#define SECONDARY_EXEC_SHADOW_VMCS		0x00004000
+// fields written from the precomputed template, see build_vmcs_template()
+#define VMCS_TEMPLATE_MAX				96
+// CH 28.2.6, Vol 3: the log is one 4K page of 512 GPAs, filled from the
+// last entry down
+#define PML_ENTITY_NUM					512
 #define VIRTUAL_PROCESSOR_ID			0x00000000
 #define POSTED_INTR_NV					0x00000002
 #define PAGE_FAULT_ERROR_CODE_MASK		0x00004006
@@ -39,9 +107,27 @@
 
 
 #define EXCEPTION_BITMAP				0x00004004
+#define VM_EXIT_INTR_INFO				0x00004404
+// CH 24.9.2, Vol 3
+#define INTR_INFO_VECTOR_MASK			0x000000ff
+#define INTR_INFO_TYPE_MASK				0x00000700
+#define INTR_TYPE_NMI_INTR				0x00000200
+#define INTR_TYPE_HARD_EXCEPTION		0x00000300
+#define NM_VECTOR						7
+#define CR0_TS							(1ULL<<3)
+// CH 10.5.1 and 13.4, Vol 1: the legacy region of an XSAVE area is the
+// FXSAVE layout, with the x87 control word at 0 and MXCSR at 24
+#define FXSAVE_SIZE						512
+#define FXSAVE_MXCSR_OFFSET				24
+#define FPU_DEFAULT_FCW					0x037f
+#define MXCSR_DEFAULT					0x1f80
 // CH B.2.1
 // Table B-4. Encodings for 64-Bit Control Fields
+#define IO_BITMAP_A						0x00002000
+#define IO_BITMAP_B						0x00002002
+#define MSR_BITMAP						0x00002004
 #define EPT_POINTER						0x0000201a
+#define PML_ADDRESS						0x0000200e
 
 
 
@@ -137,6 +223,10 @@
 #define GUEST_SYSENTER_CS				0x0000482A
 #define VMX_PREEMPTION_TIMER_VALUE		0x0000482E
 #define VMX_VMEXIT_INSTRUCTION_LENGTH 0x440c
+#define GUEST_PHYSICAL_ADDRESS			0x00002400
+#define EXIT_QUALIFICATION				0x00006400
+// EPT violation exit qualification, CH 27.2.1, Vol 3, Table 27-7
+#define EPT_VIOLATION_WRITE				(1ULL << 1)
 #define GUEST_PENDING_DBG_EXCEPTIONS	0x00006822
 #define GUEST_SYSENTER_ESP				0x00006824
 #define GUEST_SYSENTER_EIP				0x00006826
@@ -150,6 +240,6 @@
 #define MSR_IA32_SYSENTER_CS			0x00000174
 
 #define VM_EXIT_REASON			 		0x00004402
-#define VM_INSTRUCTION_ERROR			0x00004000  // CH 26.1, Vol 3
+#define VM_INSTRUCTION_ERROR			0x00004400  // CH 30.4, Vol 3
 #define EAX_EDX_VAL(val, low, high)	((low) | (high) << 32)
 #define EAX_EDX_RET(val, low, high)	"=a" (low), "=d" (high)
@@ -0,0 +1,362 @@
+#include "paging.h"
+
+#ifndef IS_ALIGNED
+#define IS_ALIGNED(x, a) (((x) & ((a) - 1)) == 0)
+#endif
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+// Non-leaf entries of every EPT level share the PML4E layout. Returns the
+// table an entry references, allocating it on first use, or NULL if the
+// entry is already a large-page leaf or the allocation fails.
+static void* ept_next_level(const struct paging_ops* ops, EPT_PML4_ENTRY* entry) {
+  void* table;
+
+  if (((EPT_PML2_2MB_ENTRY*)entry)->Fields.LargePage)
+    return NULL;
+  if (entry->Fields.Read)
+    return ops->table_va((uint64_t)entry->Fields.PhysicalAddress << 12);
+
+  table = ops->alloc_table();
+  if (!table)
+    return NULL;
+  entry->Fields.PhysicalAddress = ops->table_pa(table) >> 12;
+  entry->Fields.Read = 1;
+  entry->Fields.Write = 1;
+  entry->Fields.Execute = 1;
+  return table;
+}
+
+// CH 28.2.2, Vol 3
+// Leaves are as large as both addresses' alignment, the remaining size and
+// the CPU allow; 4K leaves elsewhere.
+bool ept_map_range(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                   uint64_t gpa, uint64_t hpa, uint64_t size, uint64_t ept_caps,
+                   bool writable) {
+  EPT_PML3_ENTRY* pml3;
+  EPT_PML2_ENTRY* pml2;
+  EPT_PML1_ENTRY* pml1;
+  uint64_t step;
+
+  while (size) {
+    pml3 = ept_next_level(ops, &pml4[EPT_PML4_INDEX(gpa)]);
+    if (!pml3)
+      return false;
+
+    if ((ept_caps & VMX_EPT_1GB_PAGE_BIT) && size >= EPT_PAGE_SIZE_1GB &&
+        IS_ALIGNED(gpa | hpa, EPT_PAGE_SIZE_1GB)) {
+      EPT_PML3_1GB_ENTRY* leaf = (EPT_PML3_1GB_ENTRY*)&pml3[EPT_PML3_INDEX(gpa)];
+      leaf->All = 0;
+      leaf->Fields.PhysicalAddress = hpa >> 30;
+      leaf->Fields.Read = 1;
+      leaf->Fields.Write = writable;
+      leaf->Fields.Execute = 1;
+      leaf->Fields.EPTMemoryType = EPT_MEMORY_TYPE_WB;
+      leaf->Fields.LargePage = 1;
+      step = EPT_PAGE_SIZE_1GB;
+      goto next;
+    }
+
+    pml2 = ept_next_level(ops, (EPT_PML4_ENTRY*)&pml3[EPT_PML3_INDEX(gpa)]);
+    if (!pml2)
+      return false;
+
+    if ((ept_caps & VMX_EPT_2MB_PAGE_BIT) && size >= EPT_PAGE_SIZE_2MB &&
+        IS_ALIGNED(gpa | hpa, EPT_PAGE_SIZE_2MB)) {
+      EPT_PML2_2MB_ENTRY* leaf = (EPT_PML2_2MB_ENTRY*)&pml2[EPT_PML2_INDEX(gpa)];
+      leaf->All = 0;
+      leaf->Fields.PhysicalAddress = hpa >> 21;
+      leaf->Fields.Read = 1;
+      leaf->Fields.Write = writable;
+      leaf->Fields.Execute = 1;
+      leaf->Fields.EPTMemoryType = EPT_MEMORY_TYPE_WB;
+      leaf->Fields.LargePage = 1;
+      step = EPT_PAGE_SIZE_2MB;
+      goto next;
+    }
+
+    pml1 = ept_next_level(ops, (EPT_PML4_ENTRY*)&pml2[EPT_PML2_INDEX(gpa)]);
+    if (!pml1)
+      return false;
+
+    pml1[EPT_PML1_INDEX(gpa)].All = 0;
+    pml1[EPT_PML1_INDEX(gpa)].Fields.PhysicalAddress = hpa >> 12;
+    pml1[EPT_PML1_INDEX(gpa)].Fields.Read = 1;
+    pml1[EPT_PML1_INDEX(gpa)].Fields.Write = writable;
+    pml1[EPT_PML1_INDEX(gpa)].Fields.Execute = 1;
+    pml1[EPT_PML1_INDEX(gpa)].Fields.EPTMemoryType = EPT_MEMORY_TYPE_WB;
+    step = EPT_PAGE_SIZE_4K;
+
+next:
+    gpa += step;
+    hpa += step;
+    size -= step;
+  }
+  return true;
+}
+
+// Large-page leaves have no table below them
+void ept_unmap_all(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4) {
+  EPT_PML3_ENTRY* pml3;
+  EPT_PML2_ENTRY* pml2;
+
+  for (int i = 0; i < 512; i++) {
+    if (!pml4[i].Fields.Read)
+      continue;
+    pml3 = ops->table_va((uint64_t)pml4[i].Fields.PhysicalAddress << 12);
+    for (int j = 0; j < 512; j++) {
+      if (!pml3[j].Fields.Read || ((EPT_PML3_1GB_ENTRY*)&pml3[j])->Fields.LargePage)
+        continue;
+      pml2 = ops->table_va((uint64_t)pml3[j].Fields.PhysicalAddress << 12);
+      for (int k = 0; k < 512; k++) {
+        if (!pml2[k].Fields.Read || ((EPT_PML2_2MB_ENTRY*)&pml2[k])->Fields.LargePage)
+          continue;
+        ops->free_table(ops->table_va((uint64_t)pml2[k].Fields.PhysicalAddress << 12));
+      }
+      ops->free_table(pml2);
+    }
+    ops->free_table(pml3);
+    pml4[i].All = 0;
+  }
+}
+
+void ept_free_tables(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4) {
+  ept_unmap_all(ops, pml4);
+  ops->free_table(pml4);
+}
+
+EPT_PML1_ENTRY* ept_pte(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                        uint64_t gpa) {
+  EPT_PML4_ENTRY* entry = &pml4[EPT_PML4_INDEX(gpa)];
+  int shift;
+
+  // the PML3 and PML2 entries referencing a table share the PML4E layout
+  for (shift = 30; shift >= 21; shift -= 9) {
+    if (!entry->Fields.Read)
+      return NULL;
+    if (shift < 30 && ((EPT_PML3_1GB_ENTRY*)entry)->Fields.LargePage)
+      return NULL;
+    entry = (EPT_PML4_ENTRY*)ops->table_va((uint64_t)entry->Fields.PhysicalAddress << 12) +
+            ((gpa >> shift) & 0x1ff);
+  }
+  if (!entry->Fields.Read || ((EPT_PML2_2MB_ENTRY*)entry)->Fields.LargePage)
+    return NULL;
+  return (EPT_PML1_ENTRY*)ops->table_va((uint64_t)entry->Fields.PhysicalAddress << 12) +
+         EPT_PML1_INDEX(gpa);
+}
+
+EPT_PML2_ENTRY* ept_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                       uint64_t gpa) {
+  EPT_PML3_ENTRY* pml3;
+
+  if (!pml4[EPT_PML4_INDEX(gpa)].Fields.Read)
+    return NULL;
+  pml3 = ops->table_va((uint64_t)pml4[EPT_PML4_INDEX(gpa)].Fields.PhysicalAddress << 12);
+  pml3 += EPT_PML3_INDEX(gpa);
+  if (!pml3->Fields.Read || ((EPT_PML3_1GB_ENTRY*)pml3)->Fields.LargePage)
+    return NULL;
+  return ops->table_va((uint64_t)pml3->Fields.PhysicalAddress << 12);
+}
+
+bool ept_link_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                 uint64_t gpa, EPT_PML2_ENTRY* pd) {
+  EPT_PML3_ENTRY* pml3 = ept_next_level(ops, &pml4[EPT_PML4_INDEX(gpa)]);
+
+  if (!pml3)
+    return false;
+  pml3 += EPT_PML3_INDEX(gpa);
+  if (pml3->Fields.Read)
+    return false;
+  pml3->All = 0;
+  pml3->Fields.PhysicalAddress = ops->table_pa(pd) >> 12;
+  pml3->Fields.Read = 1;
+  pml3->Fields.Write = 1;
+  pml3->Fields.Execute = 1;
+  return true;
+}
+
+void ept_unlink_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                   uint64_t gpa) {
+  EPT_PML3_ENTRY* pml3;
+
+  if (!pml4[EPT_PML4_INDEX(gpa)].Fields.Read)
+    return;
+  pml3 = ops->table_va((uint64_t)pml4[EPT_PML4_INDEX(gpa)].Fields.PhysicalAddress << 12);
+  pml3[EPT_PML3_INDEX(gpa)].All = 0;
+}
+
+// CH 28.2.2, Vol 3
+// The leaf mapping gpa and its size, NULL if there is none. All leaf
+// formats keep the flags and the frame address where a PTE does.
+static EPT_PML1_ENTRY* ept_leaf(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                                uint64_t gpa, uint64_t* size) {
+  EPT_PML4_ENTRY* entry = &pml4[EPT_PML4_INDEX(gpa)];
+  int shift;
+
+  if (!entry->Fields.Read)
+    return NULL;
+  for (shift = 30; shift >= 12; shift -= 9) {
+    entry = (EPT_PML4_ENTRY*)ops->table_va((uint64_t)entry->Fields.PhysicalAddress << 12) +
+            ((gpa >> shift) & 0x1ff);
+    if (!entry->Fields.Read)
+      return NULL;
+    if (shift == 12 || ((EPT_PML2_2MB_ENTRY*)entry)->Fields.LargePage) {
+      *size = 1ULL << shift;
+      return (EPT_PML1_ENTRY*)entry;
+    }
+  }
+  return NULL;
+}
+
+uint64_t ept_translate(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                       uint64_t gpa, uint64_t* hpa) {
+  uint64_t size;
+  EPT_PML1_ENTRY* leaf = ept_leaf(ops, pml4, gpa, &size);
+
+  if (!leaf)
+    return 0;
+  *hpa = (((uint64_t)leaf->Fields.PhysicalAddress << 12) & ~(size - 1)) |
+         (gpa & (size - 1));
+  return size;
+}
+
+uint64_t ept_clear_dirty(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                         uint64_t gpa) {
+  uint64_t size;
+  EPT_PML1_ENTRY* leaf = ept_leaf(ops, pml4, gpa, &size);
+
+  if (!leaf)
+    return 0;
+  leaf->Fields.DirtyFlag = 0;
+  return size;
+}
+
+static void set_page_bits(uint64_t* map, uint64_t first, uint64_t count, uint64_t limit) {
+  if (!map || first >= limit)
+    return;
+  if (count > limit - first)
+    count = limit - first;
+  for (; count && (first & 63); first++, count--)
+    map[first / 64] |= 1ULL << (first & 63);
+  for (; count >= 64; first += 64, count -= 64)
+    map[first / 64] = ~0ULL;
+  for (; count; first++, count--)
+    map[first / 64] |= 1ULL << (first & 63);
+}
+
+static bool ept_scan_shared(const struct ept_ad_scan* scan, uint64_t gpa) {
+  uint64_t window = (gpa - scan->shared_base) >> 30;
+
+  return gpa >= scan->shared_base && window < 64 &&
+         (scan->shared_windows & (1ULL << window));
+}
+
+// level 3 is the PML4, 0 a page table. Flags are cleared below this table
+// only if clear is set.
+static void ept_scan_ad_table(const struct paging_ops* ops, EPT_PML4_ENTRY* table,
+                              int level, uint64_t base, bool clear,
+                              struct ept_ad_scan* scan) {
+  int shift = 12 + 9 * level;
+
+  scan->tables++;
+  for (int i = 0; i < 512; i++) {
+    EPT_PML4_ENTRY* entry = &table[i];
+    EPT_PML1_ENTRY* leaf = (EPT_PML1_ENTRY*)entry;
+    uint64_t gpa = base + ((uint64_t)i << shift);
+    bool is_leaf = level == 0 ||
+                   (level < 3 && ((EPT_PML2_2MB_ENTRY*)entry)->Fields.LargePage);
+
+    if (!entry->Fields.Read)
+      continue;
+    // the accessed flag is bit 8 at every level
+    if (!leaf->Fields.AccessedFlag) {
+      if (!is_leaf)
+        scan->tables_skipped++;
+      continue;
+    }
+    if (is_leaf) {
+      set_page_bits(scan->accessed, gpa >> 12, 1ULL << (shift - 12), scan->pages);
+      if (leaf->Fields.DirtyFlag)
+        set_page_bits(scan->dirty, gpa >> 12, 1ULL << (shift - 12), scan->pages);
+      if (clear)
+        leaf->Fields.DirtyFlag = 0;
+    } else {
+      // the PDPT entry is this VM's own, the directory below it may not be
+      ept_scan_ad_table(ops, ops->table_va((uint64_t)entry->Fields.PhysicalAddress << 12),
+                        level - 1, gpa,
+                        clear && !(level == 2 && ept_scan_shared(scan, gpa)), scan);
+    }
+    if (clear)
+      leaf->Fields.AccessedFlag = 0;
+  }
+}
+
+void ept_scan_ad(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                 struct ept_ad_scan* scan) {
+  scan->tables = scan->tables_skipped = 0;
+  ept_scan_ad_table(ops, pml4, 3, 0, scan->clear, scan);
+}
+
+// CH 4.6, Vol 3: supervisor pages at every level. The guest runs at CPL0
+// with the host's CR4, so a user page would fault under SMEP or SMAP.
+static void set_guest_pte(guest_page_table_entry* entry, uint64_t gpa, bool leaf_large) {
+  entry->PhysicalAddress = gpa >> 12;
+  entry->Present = 1;
+  entry->ReadWrite = 1;
+  entry->UserSupervisor = 0;
+  entry->PageSize = leaf_large;
+}
+
+// One PML4 and one PDPT always suffice: guest RAM is at most 512GB. Below
+// them, a PD for every GB not covered by a 1GB page and a PT for a tail
+// that is not 2MB aligned.
+uint64_t guest_page_tables_size(uint64_t mem_size, bool gbpages) {
+  uint64_t nr_pd = gbpages ? !IS_ALIGNED(mem_size, GUEST_PAGE_SIZE_1GB) :
+                             DIV_ROUND_UP(mem_size, GUEST_PAGE_SIZE_1GB);
+  uint64_t nr_pt = !IS_ALIGNED(mem_size, GUEST_PAGE_SIZE_2MB);
+
+  return (2 + nr_pd + nr_pt) * MYPAGE_SIZE;
+}
+
+// Each piece of guest RAM gets the largest page that fits: 1GB where the
+// CPU has them, then 2MB, then 4K. The tables are packed from
+// GUEST_PAGE_TABLES up in the order PML4, PDPT, PDs, PT.
+bool guest_build_page_tables(uint8_t* ram, uint64_t mem_size, bool gbpages) {
+  uint64_t next = GUEST_PAGE_TABLES + 2 * MYPAGE_SIZE;
+  uint64_t end = GUEST_PAGE_TABLES + guest_page_tables_size(mem_size, gbpages);
+  guest_page_table_entry *pml4, *pdpt, *pd, *pt;
+  uint64_t gpa, addr, page;
+
+  if (end > GUEST_PAGE_TABLES_END || end > mem_size || mem_size > GUEST_MAX_MEM_SIZE)
+    return false;
+
+  pml4 = (guest_page_table_entry*)(ram + GUEST_PAGE_TABLES);
+  pdpt = (guest_page_table_entry*)(ram + GUEST_PAGE_TABLES + MYPAGE_SIZE);
+  set_guest_pte(&pml4[0], GUEST_PAGE_TABLES + MYPAGE_SIZE, false);
+
+  for (gpa = 0; gpa < mem_size; gpa += GUEST_PAGE_SIZE_1GB) {
+    if (gbpages && mem_size - gpa >= GUEST_PAGE_SIZE_1GB) {
+      set_guest_pte(&pdpt[gpa / GUEST_PAGE_SIZE_1GB], gpa, true);
+      continue;
+    }
+    pd = (guest_page_table_entry*)(ram + next);
+    set_guest_pte(&pdpt[gpa / GUEST_PAGE_SIZE_1GB], next, false);
+    next += MYPAGE_SIZE;
+
+    for (addr = gpa; addr < mem_size && addr < gpa + GUEST_PAGE_SIZE_1GB;
+         addr += GUEST_PAGE_SIZE_2MB) {
+      if (mem_size - addr >= GUEST_PAGE_SIZE_2MB) {
+        set_guest_pte(&pd[(addr / GUEST_PAGE_SIZE_2MB) % 512], addr, true);
+        continue;
+      }
+      // the 4K tail of guest RAM
+      pt = (guest_page_table_entry*)(ram + next);
+      set_guest_pte(&pd[(addr / GUEST_PAGE_SIZE_2MB) % 512], next, false);
+      next += MYPAGE_SIZE;
+      for (page = addr; page < mem_size; page += MYPAGE_SIZE)
+        set_guest_pte(&pt[(page / MYPAGE_SIZE) % 512], page, false);
+    }
+  }
+  return true;
+}
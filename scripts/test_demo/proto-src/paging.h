@@ -0,0 +1,107 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+// EPT and guest page-table construction. Freestanding: built into proto.ko
+// and into userspace tools, which supply table memory through paging_ops.
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#include "macro.h"
+#include "ept.h"
+
+typedef struct guest_page_table_entry {
+    uint64_t Present : 1;          // Bit 0: Present
+    uint64_t ReadWrite : 1;       // Bit 1: Read/Write
+    uint64_t UserSupervisor : 1;  // Bit 2: User/Supervisor
+    uint64_t WriteThrough : 1;    // Bit 3: PWT
+    uint64_t CacheDisable : 1;    // Bit 4: PCD
+    uint64_t Accessed : 1;        // Bit 5: Accessed
+    uint64_t Dirty : 1;           // Bit 6: Dirty (for PT entries)
+    uint64_t PageSize : 1;        // Bit 7: PS (for PDPT/PD)
+    uint64_t Ignored1 : 4;        // Bits 11:8 (Protection Key or Ignored)
+    uint64_t PhysicalAddress : 40; // Bits 51:12
+    uint64_t Available : 7;      // Bits 62:52 (Available for software)
+    uint64_t NoExecute : 1;       // Bit 63: NX
+    uint64_t Reserved : 4;       // Bit 63: NX
+} guest_page_table_entry;
+
+// EPT table memory. alloc_table returns a zeroed, 4K-aligned page or NULL;
+// table_pa and table_va convert between its address and what EPT entries hold.
+struct paging_ops {
+  void* (*alloc_table)(void);
+  void (*free_table)(void* table);
+  uint64_t (*table_pa)(void* table);
+  void* (*table_va)(uint64_t pa);
+};
+
+// CH 28.2.2, Vol 3
+// Map [gpa, gpa+size) to [hpa, hpa+size) in the EPT rooted at pml4, using
+// the 1GB and 2MB leaves that ept_caps (IA32_VMX_EPT_VPID_CAP) allows.
+// Pass 0 for 4K leaves only.
+bool ept_map_range(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                   uint64_t gpa, uint64_t hpa, uint64_t size, uint64_t ept_caps,
+                   bool writable);
+// Free every table below pml4 and clear it
+void ept_unmap_all(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4);
+// Free every table below pml4, and pml4 itself
+void ept_free_tables(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4);
+// The 4K leaf mapping gpa, NULL if gpa is unmapped or in a large page
+EPT_PML1_ENTRY* ept_pte(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                        uint64_t gpa);
+// The page directory covering gpa's 1GB, NULL if there is none or a 1GB
+// leaf maps it
+EPT_PML2_ENTRY* ept_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                       uint64_t gpa);
+// Make the entry for the 1GB at gpa reference pd, a table owned by the
+// caller, allocating the PDPT above it if needed. False if the entry is in
+// use or the allocation fails.
+bool ept_link_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                 uint64_t gpa, EPT_PML2_ENTRY* pd);
+// Clear the entry for the 1GB at gpa without freeing what it references
+void ept_unlink_pd(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                   uint64_t gpa);
+// Software EPT walk: the size of the leaf mapping gpa, 0 if there is none
+uint64_t ept_translate(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                       uint64_t gpa, uint64_t* hpa);
+// CH 28.3.5, Vol 3
+// Clear the dirty flag of the leaf mapping gpa, so the next write to it is
+// logged again. Returns the leaf size, 0 if there is none.
+uint64_t ept_clear_dirty(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                         uint64_t gpa);
+
+// What ept_scan_ad() reads and reports. Bitmaps have a bit per 4K page,
+// bit n of word n / 64 for GPA n * 4096; a large leaf sets the bits of all
+// its pages.
+struct ept_ad_scan {
+  uint64_t* accessed;      // pages under a leaf with the accessed flag, may be NULL
+  uint64_t* dirty;         // pages under a leaf with the dirty flag, may be NULL
+  uint64_t pages;          // bits in each bitmap; pages past them are ignored
+  bool clear;              // clear both flags on every entry that had them
+  // 1GB windows from shared_base (bit n for shared_base + n GB) whose page
+  // directories other VMs use too: their flags are read but never cleared,
+  // since those VMs' CPUs may be setting them meanwhile
+  uint64_t shared_base;
+  uint64_t shared_windows;
+  uint64_t tables;         // out: tables read, including pml4
+  uint64_t tables_skipped; // out: tables not read because their entry was not accessed
+};
+// CH 28.3.5, Vol 3
+// Collect the accessed and dirty flags of every EPT leaf. The CPU sets the
+// accessed flag of every entry on the way to a leaf it uses, so a table
+// whose referencing entry has it clear is skipped with everything below.
+// Bits are only ever set in the bitmaps, never cleared.
+void ept_scan_ad(const struct paging_ops* ops, EPT_PML4_ENTRY* pml4,
+                 struct ept_ad_scan* scan);
+
+// Bytes of guest page tables guest_build_page_tables() writes for mem_size
+uint64_t guest_page_tables_size(uint64_t mem_size, bool gbpages);
+// Identity-map [0, mem_size) with tables at GUEST_PAGE_TABLES in guest RAM,
+// which starts at ram and must be zeroed there. False if they do not fit.
+bool guest_build_page_tables(uint8_t* ram, uint64_t mem_size, bool gbpages);
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef PROTO_IOCTL_H
+#define PROTO_IOCTL_H
+
+// ioctl interface of /dev/proto, shared by proto.ko and userspace clients
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PROTO_IOC_MAGIC 0xAF
+
+// guest RAM size used when proto_vm_config.mem_size is 0
+#define PROTO_DEFAULT_MEM_SIZE (4096ULL * 512)
+
+// proto_vm_config.flags
+#define PROTO_VM_NO_VPID (1ULL << 0) // flush guest TLB entries on every entry and exit
+#define PROTO_VM_DIRTY_LOG (1ULL << 1) // log guest writes with PML, see PROTO_GET_DIRTY_LOG
+#define PROTO_VM_USER_CONSOLE (1ULL << 2) // the caller reads the console ring itself, see PROTO_HC_CONSOLE_SETUP
+
+// The guest starts in 64-bit mode at RIP 0 with RSP 0x1000, or where
+// PROTO_LOAD_IMAGE says. Its page tables, from GPA 0x10000 up to at most
+// 0x20000 (CR3 0x10000), identity-map all of guest RAM with 1GB pages where
+// the CPU supports them, 2MB pages otherwise and 4K pages for a tail that
+// is not 2MB aligned. Without 1GB pages this limits guest RAM to 14GB.
+struct proto_vm_config {
+  __u64 mem_size; // guest-physical address space (page multiple), 0 for PROTO_DEFAULT_MEM_SIZE
+  __u64 flags;    // PROTO_VM_*
+  __u64 time_slice_us; // longest PROTO_RUN, 0 for the time_slice_us module parameter (0: no limit)
+};
+
+struct proto_vm_stats {
+  __u64 demand_faults;  // EPT violations satisfied by populating a region
+  __u64 resident_bytes; // guest memory currently backed by host pages
+  __u64 hypercalls;     // hypercall ring entries processed
+  __u64 tlb_flushes;    // INVEPT/INVVPID rounds issued by the host
+  __u32 vpid;           // 0 if the VM runs without VPID
+  __u32 reserved;
+  __u64 reset_pages;    // guest pages restored by PROTO_RESET
+  __u64 pml_flushes;    // PML logs drained into the dirty log
+  __u64 fpu_loads;      // runs in which the guest used x87/SSE/AVX
+  __u64 vmcs_setup_cycles; // TSC cycles PROTO_CREATE_VM spent initializing the VMCS
+  __u32 vmx_nested;     // 1 if proto.ko itself runs under a hypervisor
+  __u32 vmcs_shadowing; // 1 if the CPU offers VMCS shadowing
+  __u64 shared_bytes;   // guest memory still read from a shared image
+  __u64 cow_chunks;     // 2MB regions copied out of a shared image on a write
+  __u64 console_gpa;    // the registered console ring, ~0 for none
+  __u64 console_bytes;  // console output the module printed
+  __u64 console_dropped; // console output the guest overwrote before it was printed
+};
+
+// One bit per 4K page of guest RAM, bit n of 64-bit word n / 64 for the
+// page at GPA n * 4096. A write anywhere in a 2MB or 1GB EPT page sets
+// the bits of the whole page.
+struct proto_dirty_log {
+  __u64 bitmap;      // user address of the bitmap
+  __u64 bitmap_size; // bytes there, at least (mem_size / 4096 + 63) / 64 * 8
+  __u64 dirty_pages; // out: bits set
+};
+
+// proto_working_set.flags
+#define PROTO_WS_CLEAR (1U << 0) // clear the flags read, starting a new interval
+
+// Pages the guest accessed and wrote, from the EPT accessed and dirty
+// flags, in two bitmaps laid out like proto_dirty_log's. Both flags are
+// per EPT leaf, so a touch anywhere in a 2MB or 1GB EPT page marks the
+// whole page. The CPU sets them for the guest's own page-table walks too.
+struct proto_working_set {
+  __u64 accessed;       // user address of the accessed bitmap, 0 for none
+  __u64 dirty;          // user address of the dirty bitmap, 0 for none
+  __u64 bitmap_size;    // bytes at each, at least (mem_size / 4096 + 63) / 64 * 8
+  __u32 flags;          // PROTO_WS_*
+  __u32 reserved;
+  __u64 accessed_pages; // out: bits set in the accessed bitmap
+  __u64 dirty_pages;    // out: bits set in the dirty bitmap
+  __u64 tables_scanned; // out: EPT tables read
+  __u64 tables_skipped; // out: EPT tables skipped, nothing under them was accessed
+};
+
+// A read-only guest image that any number of VMs map without copying it.
+// The module keeps its own copy of [user_addr, user_addr+size), so the
+// caller's buffer can be reused once the ioctl returns. The image lives as
+// long as the returned file descriptor or a VM mapping it.
+struct proto_shared_image {
+  __u64 user_addr;
+  __u64 size;        // rounded up to 2MB, at most 64GB
+  __s32 fd;          // out: the image
+  __u32 reserved;
+};
+
+// Map a shared image at guest_addr. It must be 1GB aligned, at least 1GB
+// (the guest page tables live below) and nothing there may be backed yet.
+// The guest reads the image in place; its first write to a 2MB region, or
+// a fault through mmap() of it, copies that region into private memory.
+struct proto_image_map {
+  __s32 fd;          // from PROTO_CREATE_SHARED_IMAGE
+  __u32 reserved;
+  __u64 guest_addr;
+};
+
+// basic exit reasons are 0..64 (Appendix C, Vol 3)
+#define PROTO_EXIT_REASONS 65
+
+struct proto_exit_stats {
+  __u64 count[PROTO_EXIT_REASONS];  // exits by basic exit reason
+  __u64 cycles[PROTO_EXIT_REASONS]; // TSC cycles the module spent handling them
+};
+
+// proto_intercept.kind
+#define PROTO_INTERCEPT_IO        0 // ports first..first+count-1
+#define PROTO_INTERCEPT_MSR_READ  1 // MSRs in 0..0x1fff or 0xc0000000..0xc0001fff
+#define PROTO_INTERCEPT_MSR_WRITE 2
+
+// Every port and MSR traps by default. A pass-through access reaches the
+// host's hardware: only let through what is safe to share with the guest.
+// MSR writes always trap, and only reads of the SYSENTER MSRs, FS and GS
+// base (switched with the guest state) and the TSC pass through; -EPERM
+// for anything else.
+struct proto_intercept {
+  __u32 kind;  // PROTO_INTERCEPT_*
+  __u32 first; // first port or MSR index
+  __u32 count;
+  __u32 trap;  // 1 to exit to userspace, 0 to pass through
+};
+
+struct proto_mem_load {
+  __u64 guest_addr; // destination GPA
+  __u64 size;       // bytes to copy
+  __u64 user_addr;  // source buffer in the caller's address space
+};
+
+// proto_image_load.format
+#define PROTO_IMAGE_FLAT 0 // raw bytes loaded at load_addr
+#define PROTO_IMAGE_ELF  1 // ELF64 x86-64 ET_EXEC, PT_LOAD segments at p_paddr
+
+// ELF images may have at most this many program headers
+#define PROTO_IMAGE_MAX_PHDRS 64
+
+// Image segments must not overlap the guest page tables (0x10000-0x20000).
+struct proto_image_load {
+  __u64 user_addr; // the whole image in the caller's address space
+  __u64 size;      // image bytes
+  __u32 format;    // PROTO_IMAGE_*
+  __u32 reserved;
+  __u64 load_addr; // flat: GPA of the first byte; ELF: unused
+  __u64 entry;     // flat: RIP, 0 for load_addr; ELF: out, e_entry
+  __u64 stack;     // RSP, 0 for 0x1000; out: the RSP used
+};
+
+// Guest hypercalls: VMCALL with the number in RAX and arguments in RBX, RCX.
+// Only ring entries report a result.
+#define PROTO_HC_NOP        0
+#define PROTO_HC_PRINT_INT  1 // printk arg0
+#define PROTO_HC_PRINT_STR  2 // printk arg1 (<= PROTO_HC_MAX_STR) bytes at GPA arg0
+// Back [arg0, arg0+arg1) before the guest resumes instead of on first
+// touch. One range per ring kick, -EBUSY for the next.
+#define PROTO_HC_POPULATE   3
+// VMCALL only: register the struct proto_hc_ring at page-aligned GPA RBX.
+// Both indices are reset to 0.
+#define PROTO_HC_RING_SETUP 4
+// VMCALL only: the doorbell. Every queued entry is processed before the
+// guest resumes.
+#define PROTO_HC_RING_KICK  5
+// VMCALL only: register the struct proto_console_ring at 8-byte aligned
+// GPA RBX, with its size already set. Output already in it is skipped.
+#define PROTO_HC_CONSOLE_SETUP 6
+
+#define PROTO_HC_MAX_STR 256
+#define PROTO_HC_RING_ENTRIES 127
+
+struct proto_hc_entry {
+  __u32 op;      // PROTO_HC_*
+  __s32 result;  // 0 or -errno, written by the host
+  __u64 args[3];
+};
+
+// One page. The guest fills entries[head] and advances head; the host
+// processes entries[tail] and advances tail. Both wrap at
+// PROTO_HC_RING_ENTRIES, and the ring is full when head + 1 == tail.
+struct proto_hc_ring {
+  __u32 head; // written by the guest
+  __u32 tail; // written by the host
+  __u32 reserved[6];
+  struct proto_hc_entry entries[PROTO_HC_RING_ENTRIES];
+};
+
+// Guest output that costs no exit. The guest copies bytes to
+// data[head % size] and then advances head; nothing is ever written back,
+// so it never waits for the reader, which keeps its own position and loses
+// what the guest wrote more than size bytes ahead of it. The module prints
+// each line to the kernel log while the guest runs (see the console_poll_ms
+// module parameter) and after every run. With PROTO_VM_USER_CONSOLE it
+// leaves the ring alone, and the caller reads it through mmap() of guest
+// RAM instead. The ring must not cross a 2MB boundary of guest RAM.
+struct proto_console_ring {
+  __u32 head;   // bytes written since the ring was set up
+  __u32 size;   // bytes in data, a power of two; read once at setup
+  __u8 data[];
+};
+
+// mmap() of /dev/proto (MAP_SHARED) maps guest RAM: file offset N is GPA N.
+// Pages are backed on first touch. PROTO_DESTROY_VM fails with EBUSY while
+// a mapping exists.
+//
+// One page at PROTO_RUN_PAGE_OFFSET, past the largest guest RAM, maps the
+// vCPU's struct proto_run instead. It describes why the last PROTO_RUN
+// returned and stays valid for the life of the file descriptor. Userspace
+// writes only io.data after an IN and msr.data after an RDMSR.
+#define PROTO_RUN_PAGE_OFFSET (1ULL << 39)
+
+// proto_run.exit_reason. VMCALL, CPUID and EPT faults on guest RAM are
+// handled in the kernel and never reach userspace.
+#define PROTO_EXIT_UNKNOWN    0 // see hw_exit_reason
+#define PROTO_EXIT_HLT        1 // the guest is done
+#define PROTO_EXIT_IO         2 // the next PROTO_RUN continues after it, except for INS/OUTS
+#define PROTO_EXIT_MMIO       3 // access outside guest RAM
+#define PROTO_EXIT_SHUTDOWN   4 // triple fault
+#define PROTO_EXIT_FAIL_ENTRY 5 // VMLAUNCH or VMRESUME failed, hw_exit_reason is the VM-instruction error
+#define PROTO_EXIT_INTERNAL   6 // the kernel could not handle an exit, e.g. out of memory
+#define PROTO_EXIT_MSR        7 // RDMSR or WRMSR of a trapped MSR, the next PROTO_RUN continues after it
+#define PROTO_EXIT_PREEMPTED  8 // time slice used up or a signal pending, the next PROTO_RUN continues
+
+struct proto_regs {
+  __u64 rax, rbx, rcx, rdx, rsi, rdi, rbp;
+  __u64 r8, r9, r10, r11, r12, r13, r14, r15;
+  __u64 rip, rsp, rflags;
+};
+
+struct proto_run {
+  __u32 exit_reason;        // PROTO_EXIT_*
+  __u32 hw_exit_reason;     // VMX basic exit reason
+  __u64 exit_qualification;
+  __u64 in_kernel_exits;    // exits handled without returning to userspace
+  struct proto_regs regs;   // guest registers at the exit
+  union {
+    struct {
+      __u16 port;
+      __u8 size;   // bytes: 1, 2 or 4
+      __u8 in;     // 1 for IN/INS, 0 for OUT/OUTS
+      __u8 string; // INS/OUTS
+      __u32 data;  // OUT: the value; IN: set before the next PROTO_RUN
+    } io;
+    struct {
+      __u64 gpa;
+      __u8 write;
+    } mmio;
+    struct {
+      __u32 index;
+      __u8 write;
+      __u64 data; // WRMSR: the value; RDMSR: set before the next PROTO_RUN
+    } msr;
+  };
+};
+
+// Allocate VMCS, EPT and guest memory once; they are reused by every run
+#define PROTO_CREATE_VM   _IOW(PROTO_IOC_MAGIC, 0x00, struct proto_vm_config)
+// Copy an image into guest memory
+#define PROTO_LOAD_MEM    _IOW(PROTO_IOC_MAGIC, 0x01, struct proto_mem_load)
+// Load an ELF or flat image and make the next PROTO_RUN start at its entry
+// point with the given stack, instead of RIP 0 and RSP 0x1000
+#define PROTO_LOAD_IMAGE  _IOWR(PROTO_IOC_MAGIC, 0x0a, struct proto_image_load)
+// Run the guest from its entry point, or from where it was preempted, until
+// an exit the module does not handle, which is described in the run page
+#define PROTO_RUN         _IO(PROTO_IOC_MAGIC, 0x02)
+// Free everything allocated by PROTO_CREATE_VM
+#define PROTO_DESTROY_VM  _IO(PROTO_IOC_MAGIC, 0x03)
+// Read the VM's counters
+#define PROTO_GET_STATS   _IOR(PROTO_IOC_MAGIC, 0x04, struct proto_vm_stats)
+// Read the module-wide exit counters, summed over all CPUs and vCPUs. They
+// are never reset; diff two reads to measure an interval.
+#define PROTO_GET_EXIT_STATS _IOR(PROTO_IOC_MAGIC, 0x05, struct proto_exit_stats)
+// Choose whether a range of ports or MSRs traps or passes through
+#define PROTO_SET_INTERCEPT _IOW(PROTO_IOC_MAGIC, 0x06, struct proto_intercept)
+// Capture guest memory and registers as the next PROTO_RUN would start
+// from them: the entry state, or where the guest was preempted. Replaces an
+// earlier snapshot. The guest's first write to each page after it or after
+// a PROTO_RESET costs one exit.
+#define PROTO_SNAPSHOT    _IO(PROTO_IOC_MAGIC, 0x07)
+// Undo every guest write since the snapshot and restore its registers; the
+// next PROTO_RUN continues from the snapshot. Writes through mmap() or
+// PROTO_LOAD_MEM are not undone, so they can feed each run a new input.
+#define PROTO_RESET       _IO(PROTO_IOC_MAGIC, 0x08)
+// Copy out the pages the guest wrote since the last call and start a new
+// log. Needs PROTO_VM_DIRTY_LOG; writes through mmap() or PROTO_LOAD_MEM
+// are not logged.
+#define PROTO_GET_DIRTY_LOG _IOWR(PROTO_IOC_MAGIC, 0x09, struct proto_dirty_log)
+// Copy out the guest's working set since the VM was created or since the
+// last call with PROTO_WS_CLEAR. Fails with EOPNOTSUPP on CPUs without EPT
+// accessed and dirty flags. Accesses through mmap() or PROTO_LOAD_MEM are
+// not seen.
+#define PROTO_GET_WORKING_SET _IOWR(PROTO_IOC_MAGIC, 0x0b, struct proto_working_set)
+// Copy a guest image into the module once and return it as a file
+// descriptor; needs no VM. Fails with EOPNOTSUPP on CPUs without 2MB EPT
+// pages.
+#define PROTO_CREATE_SHARED_IMAGE _IOWR(PROTO_IOC_MAGIC, 0x0c, struct proto_shared_image)
+// Map a shared image into this VM, once per VM. A PROTO_SNAPSHOT taken
+// later stops the sharing: the regions still read from the image are
+// copied on their next access, and PROTO_RESET restores the image's bytes.
+// The EPT accessed flags PROTO_GET_WORKING_SET reads for the image are
+// those of every VM sharing it. PROTO_WS_CLEAR does not clear them, as the
+// other VMs' CPUs may be setting them at the same time: an image page any
+// VM touched stays in the working set, reported whenever this VM touched
+// the same 1GB since the last clear.
+#define PROTO_MAP_SHARED_IMAGE _IOW(PROTO_IOC_MAGIC, 0x0d, struct proto_image_map)
+
+#endif
@@ -15,14 +15,28 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/cpu.h>
+#include <linux/percpu.h>
 #include <linux/notifier.h>
 #include <linux/uaccess.h>
 #include <linux/gfp.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <asm/errno.h>
+#include <asm/tsc.h>
+#include <asm/processor.h>
+#include <asm/cpufeature.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
 #include <linux/cpumask.h>
+#include <linux/idr.h>
+#include <linux/bitmap.h>
+#include <linux/elf.h>
+#include <asm/fpu/api.h>
+#include <linux/kref.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
 
 #include "macro.h"
 #include "protovirt.h"
@@ -35,19 +49,171 @@ static struct cdev *my_cdev;
 static struct class *my_class;
 static struct device *my_device;
 
-static DEFINE_MUTEX(vmx_mutex);
+// Every CPU has its own VMXON region; vCPUs are per open file and run on
+// whichever CPU their caller is on
+static DEFINE_PER_CPU(uint64_t*, vmxon_region);
+static DEFINE_PER_CPU(bool, vmx_enabled);
+// vCPU whose guest is running on this CPU, for the legacy vmexit_handler()
+static DEFINE_PER_CPU(struct vcpu*, current_vcpu);
+static atomic_t vmxon_failures;
+// IA32_VMX_EPT_VPID_CAP, read once at load
+static uint64_t vmx_ept_vpid_caps;
+// VPIDs of all VMs; 0 is never handed out
+static DEFINE_IDA(vpid_ida);
+// CH 13.2, Vol 1: the guest runs with the host's XCR0, so its extended
+// state has the host's components and XSAVE layout. 0 without XSAVE, when
+// FXSAVE covers x87 and SSE.
+static uint64_t guest_xfeatures;
+static unsigned int guest_fpu_size;
+// 0 if the CPU has no VMX preemption timer and runs are not time-sliced
+static bool preemption_timer_supported;
+static uint8_t preemption_timer_rate;
+
+static unsigned int time_slice_us = 10000;
+module_param(time_slice_us, uint, 0644);
+MODULE_PARM_DESC(time_slice_us, "Longest PROTO_RUN in microseconds for VMs created without one, 0 for no limit");
+// exit counters of this CPU; only vmexit_dispatch() writes them
+static DEFINE_PER_CPU(struct proto_exit_stats, exit_stats);
+
+// Exits are handled without any logging unless this is set, e.g. with
+// echo 1 > /sys/module/proto/parameters/verbose_exits
+static bool verbose_exits;
+module_param(verbose_exits, bool, 0644);
+MODULE_PARM_DESC(verbose_exits, "Decode every VM exit to the kernel log");
+
+// Runs go through proto_vcpu_run() in proto_asm.S unless this is set. The
+// old path, _vmlaunch() and vmexit_handler(), is kept to measure the
+// difference, see proto_exit_bench --compare.
+static bool legacy_exit_path;
+module_param(legacy_exit_path, bool, 0644);
+MODULE_PARM_DESC(legacy_exit_path, "Run guests through the old C VM-exit path");
+
+// New VMCSs are filled from vmcs_template unless this is set, which keeps
+// the old field-by-field setup to compare against, see proto_bench
+static bool legacy_vmcs_setup;
+module_param(legacy_vmcs_setup, bool, 0644);
+MODULE_PARM_DESC(legacy_vmcs_setup, "Initialize each VMCS field by field, reading host fields back");
+
+// Guest console rings are printed every console_poll_ms by console_thread,
+// which walks console_vcpus and leaves what one drain does not print to
+// the next poll, and after every run
+static unsigned int console_poll_ms = 10;
+module_param(console_poll_ms, uint, 0644);
+MODULE_PARM_DESC(console_poll_ms, "Interval in milliseconds at which guest console output is printed while guests run, 0 for only after each run");
+static LIST_HEAD(console_vcpus);
+static DEFINE_MUTEX(console_vcpus_lock);
+static struct task_struct* console_thread;
+
+// Nested, every VMREAD and VMWRITE not covered by the outer hypervisor's
+// shadow VMCS exits to it. The VMCS fields that are the same for every VM
+// are therefore computed once, from the capability MSRs and host
+// registers, and written from this table without reading anything back.
+struct vmcs_field_value {
+  uint32_t field;
+  uint64_t value;
+};
+
+static struct vmcs_field_value vmcs_template[VMCS_TEMPLATE_MAX];
+static unsigned int vmcs_template_len;
+// secondary controls before the per-VM VPID and PML bits
+static uint32_t vmcs_proc2_template;
+static bool vmx_nested;
+static bool vmcs_shadowing;
+static void build_vmcs_template(void);
+
+// Pages freed back to the per-node pools are kept up to these counts per
+// node, see pool_free()
+static unsigned int pool_pages = 256;
+module_param(pool_pages, uint, 0644);
+MODULE_PARM_DESC(pool_pages, "4K pages (VMCS, EPT tables) kept for reuse per NUMA node");
+static unsigned int pool_chunks = 32;
+module_param(pool_chunks, uint, 0644);
+MODULE_PARM_DESC(pool_chunks, "2MB guest RAM chunks kept for reuse per NUMA node");
+
+// VMX regions, EPT tables and guest RAM are taken from and freed to a pool
+// per NUMA node, indexed by POOL_PAGE or POOL_CHUNK. Creating and
+// destroying VMs then reuses the same, cache-warm pages instead of going
+// through the page allocator, and a VM's memory stays on its node.
+struct page_pool {
+  spinlock_t lock;
+  struct list_head free[POOL_KINDS];
+  unsigned int count[POOL_KINDS];
+};
 
-static int set_cpu_affinity(struct task_struct *task, int cpu) {
-    int ret;
-    struct cpumask *mask = kzalloc(sizeof(struct cpumask), GFP_KERNEL);
-    if (!mask)
-        return -ENOMEM;
+static const unsigned int pool_order[POOL_KINDS] = { 0, GUEST_CHUNK_ORDER };
+static unsigned int* const pool_limit[POOL_KINDS] = { &pool_pages, &pool_chunks };
+static struct page_pool* page_pools;
 
-    cpumask_clear(mask);
-    cpumask_set_cpu(cpu, mask);
-    ret = set_cpus_allowed_ptr(task, mask);
-    kfree(mask);
-    return ret;
+static bool page_pools_init(void) {
+  int node;
+
+  page_pools = kcalloc(nr_node_ids, sizeof(*page_pools), GFP_KERNEL);
+  if (!page_pools)
+    return false;
+  for_each_node(node) {
+    spin_lock_init(&page_pools[node].lock);
+    for (int kind = 0; kind < POOL_KINDS; kind++)
+      INIT_LIST_HEAD(&page_pools[node].free[kind]);
+  }
+  return true;
+}
+
+static void page_pools_drain(void) {
+  struct page* page;
+  int node;
+
+  for_each_node(node) {
+    for (int kind = 0; kind < POOL_KINDS; kind++) {
+      while (!list_empty(&page_pools[node].free[kind])) {
+        page = list_first_entry(&page_pools[node].free[kind], struct page, lru);
+        list_del(&page->lru);
+        __free_pages(page, pool_order[kind]);
+      }
+    }
+  }
+  kfree(page_pools);
+}
+
+// Pages of the pool on node, else new ones preferably from node. Callers
+// include the VM-exit path, so the lock is never held while allocating or
+// zeroing.
+static void* pool_alloc(int kind, int node, gfp_t gfp) {
+  struct page_pool* pool = &page_pools[node];
+  struct page* page = NULL;
+
+  spin_lock(&pool->lock);
+  if (!list_empty(&pool->free[kind])) {
+    page = list_first_entry(&pool->free[kind], struct page, lru);
+    list_del(&page->lru);
+    pool->count[kind]--;
+  }
+  spin_unlock(&pool->lock);
+  if (!page)
+    page = alloc_pages_node(node, gfp | __GFP_NOWARN, pool_order[kind]);
+  else if (gfp & __GFP_ZERO)
+    memset(page_address(page), 0, PAGE_SIZE << pool_order[kind]);
+  return page ? page_address(page) : NULL;
+}
+
+// Back to the pool of the node the pages are on, or to the page allocator
+// once that pool is full
+static void pool_free(int kind, void* addr) {
+  struct page_pool* pool;
+  struct page* page;
+
+  if (!addr)
+    return;
+  page = virt_to_page(addr);
+  pool = &page_pools[page_to_nid(page)];
+  spin_lock(&pool->lock);
+  if (pool->count[kind] < READ_ONCE(*pool_limit[kind])) {
+    list_add(&page->lru, &pool->free[kind]);
+    pool->count[kind]++;
+    page = NULL;
+  }
+  spin_unlock(&pool->lock);
+  if (page)
+    __free_pages(page, pool_order[kind]);
 }
 
 // CH 23.6, Vol 3
@@ -71,14 +237,16 @@ bool vmxSupport(void)
 }
 
 // CH 23.7, Vol 3
-// Enter in VMX mode
-bool getVmxOperation(void) {
+// Enter in VMX mode on the calling CPU, run through on_each_cpu()
+static void vmxonCpu(void* unused) {
 	unsigned long cr4;
 	unsigned long cr0;
   uint64_t feature_control;
 	uint64_t required;
 	long int vmxon_phy_region = 0;
 	u32 low1 = 0;
+  uint64_t* region = this_cpu_read(vmxon_region);
+
     // setting CR4.VMXE[bit 13] = 1
     __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4) : : "memory");
     cr4 |= X86_CR4_VMXE;
@@ -113,146 +281,493 @@ bool getVmxOperation(void) {
 	cr4 |= __rdmsr1(MSR_IA32_VMX_CR4_FIXED0);
 	__asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
 
-	// allocating 4kib((4096 bytes) of memory for vmxon region
-	cpu.vmxonRegion = kzalloc(MYPAGE_SIZE,GFP_KERNEL);
-   	if(cpu.vmxonRegion==NULL){
-		printk(KERN_INFO "Error allocating vmxon region\n");
-      	return false;
-   	}
-	vmxon_phy_region = __pa(cpu.vmxonRegion);
-	*(uint32_t *)cpu.vmxonRegion = vmcs_revision_id();
-	if (_vmxon(vmxon_phy_region))
-		return false;
+	if (!region) {
+		atomic_inc(&vmxon_failures);
+		return;
+	}
+	vmxon_phy_region = __pa(region);
+	*(uint32_t *)region = vmcs_revision_id();
+	if (_vmxon(vmxon_phy_region)) {
+		atomic_inc(&vmxon_failures);
+		return;
+	}
+	this_cpu_write(vmx_enabled, true);
+}
+
+static void vmxoffCpu(void* unused) {
+  if (!this_cpu_read(vmx_enabled))
+    return;
+	asm volatile ("vmxoff\n" : : : "cc");
+  this_cpu_write(vmx_enabled, false);
+}
+
+bool getVmxOperation(void) {
+  int cpu;
+
+  vmx_ept_vpid_caps = __rdmsr1(MSR_IA32_VMX_EPT_VPID_CAP);
+  preemption_timer_supported =
+      (__rdmsr1(MSR_IA32_VMX_PINBASED_CTLS) >> 32) & PIN_BASED_VMX_PREEMPTION_TIMER;
+  preemption_timer_rate = __rdmsr1(MSR_IA32_VMX_MISC) & VMX_MISC_PREEMPTION_TIMER_RATE_MASK;
+  if (!preemption_timer_supported)
+    printk(KERN_INFO "VMX: no preemption timer, guest runs are not time-sliced\n");
+  // CH 25.10, Vol 3: a hypervisor under us may make our VMREAD and
+  // VMWRITE cheap with a shadow VMCS; either way there is nothing for us to
+  // enable, only accesses to save
+  vmx_nested = boot_cpu_has(X86_FEATURE_HYPERVISOR);
+  vmcs_shadowing = (__rdmsr1(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32) & SECONDARY_EXEC_SHADOW_VMCS;
+  if (vmx_nested)
+    printk(KERN_INFO "VMX: running nested, VMCS shadowing %s\n",
+           vmcs_shadowing ? "offered" : "not offered");
+  if (boot_cpu_has(X86_FEATURE_XSAVE)) {
+    guest_xfeatures = xgetbv1(0);
+    // bytes needed for the components enabled in XCR0
+    guest_fpu_size = cpuid_ebx(0xd);
+  } else {
+    guest_fpu_size = FXSAVE_SIZE;
+  }
+
+	// allocating 4kib((4096 bytes) of memory for each vmxon region; the
+	// IPI handlers below cannot allocate
+  for_each_online_cpu(cpu) {
+    per_cpu(vmxon_region, cpu) = pool_alloc(POOL_PAGE, cpu_to_node(cpu), GFP_KERNEL | __GFP_ZERO);
+    if (!per_cpu(vmxon_region, cpu)) {
+      printk(KERN_INFO "Error allocating vmxon region\n");
+      deallocate_vmxon_region();
+      return false;
+    }
+  }
+
+  build_vmcs_template();
+
+  atomic_set(&vmxon_failures, 0);
+  on_each_cpu(vmxonCpu, NULL, 1);
+  if (atomic_read(&vmxon_failures)) {
+    printk(KERN_INFO "VMXON failed on %d CPUs\n", atomic_read(&vmxon_failures));
+    vmxoffOperation();
+    return false;
+  }
 	return true;
 }
 
 // CH 24.2, Vol 3
 // allocating VMCS region
-bool vmcsOperations(void) {
-	long int vmcsPhyRegion = 0;
-	if (allocVmcsRegion()){
-		vmcsPhyRegion = __pa(cpu.vmcsRegion);
-		*(uint32_t *)cpu.vmcsRegion = vmcs_revision_id();
+bool vmcsOperations(struct vcpu* vcpu) {
+	if (allocVmcsRegion(vcpu)){
+		*(uint32_t *)vcpu->vmcsRegion = vmcs_revision_id();
 	}
 	else {
 		return false;
 	}
+  vcpu->cpu = -1;
+	return true;
+}
+
+static void vmclearOnCpu(void* info) {
+  struct vcpu* vcpu = info;
+  _vmclear(__pa(vcpu->vmcsRegion));
+}
+
+// CH 24.1, Vol 3
+// A VMCS may be active on one CPU only. Flush it there so it can be made
+// current somewhere else or freed.
+void vcpu_clear(struct vcpu* vcpu) {
+  if (vcpu->cpu < 0)
+    return;
+  smp_call_function_single(vcpu->cpu, vmclearOnCpu, vcpu, 1);
+  vcpu->cpu = -1;
+  vcpu->launched = false;
+}
+
+// Make the vCPU's VMCS current on cpu (the caller's CPU, with preemption
+// disabled). A VMCS that is new or comes from another CPU is cleared
+// first and launched again; on the same CPU it keeps its launch state, so
+// the run loop resumes it, and only needs VMPTRLD in case another vCPU's
+// VMCS was made current there meanwhile. All fields written at creation
+// are kept.
+bool vcpu_load(struct vcpu* vcpu, int cpu) {
+  uint64_t vmcs_phys = __pa(vcpu->vmcsRegion);
+  bool migrated = vcpu->cpu != cpu;
+
+  if (migrated) {
+    vcpu_clear(vcpu);
+    if (_vmclear(vmcs_phys))
+      return false;
+  }
 
 	//making the vmcs active and current
-	if (_vmptrld(vmcsPhyRegion))
+	if (_vmptrld(vmcs_phys))
 		return false;
-	return true;
+  vcpu->cpu = cpu;
+  if (migrated) {
+    refresh_host_cpu_state();
+    // this CPU may still cache translations from an earlier visit, or
+    // from a destroyed VM that had the same EPTP or VPID
+    vcpu->tlb_dirty = true;
+  }
+  return true;
+}
+
+// CH 28.3.3, Vol 3
+// With VPID on, VM entries and exits keep the guest's TLB entries, so they
+// are only dropped here: when the vCPU arrives on a CPU or the host changed
+// the guest's page tables. The EPT only ever gains mappings, which needs
+// no invalidation, except where a shared image is copied on write, see
+// unshare_image_region(). Without VPID every entry and exit flushes the guest's
+// linear mappings, but EPT-derived ones still need INVEPT.
+void vcpu_flush_tlb(struct vcpu* vcpu) {
+  if (vmx_ept_vpid_caps & VMX_EPT_INVEPT_SINGLE_BIT)
+    _invept(INVEPT_SINGLE_CONTEXT, vcpu->eptp);
+  else if (vmx_ept_vpid_caps & VMX_EPT_INVEPT_ALL_BIT)
+    _invept(INVEPT_ALL_CONTEXT, 0);
+
+  if (vcpu->vpid) {
+    if (vmx_ept_vpid_caps & VMX_VPID_INVVPID_SINGLE_BIT)
+      _invvpid(INVVPID_SINGLE_CONTEXT, vcpu->vpid, 0);
+    else
+      _invvpid(INVVPID_ALL_CONTEXT, 0, 0);
+  }
+  vcpu->tlb_dirty = false;
+  vcpu->stats.tlb_flushes++;
+}
+
+// VPID is only used when it can be invalidated per VPID or globally
+static bool vpid_supported(void) {
+  uint32_t secondary_allowed1 = __rdmsr1(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+  return (secondary_allowed1 & SECONDARY_EXEC_ENABLE_VPID) &&
+         (vmx_ept_vpid_caps & VMX_VPID_INVVPID_BIT) &&
+         (vmx_ept_vpid_caps & (VMX_VPID_INVVPID_SINGLE_BIT | VMX_VPID_INVVPID_ALL_BIT));
+}
+
+// CH 28.3.6, Vol 3: PML logs the writes that set EPT dirty flags
+static bool pml_supported(void) {
+  uint32_t secondary_allowed1 = __rdmsr1(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+  return (secondary_allowed1 & SECONDARY_EXEC_ENABLE_PML) &&
+         (vmx_ept_vpid_caps & VMX_EPT_AD_BIT);
 }
 
 bool vmxoffOperation(void)
 {
-  set_cpu_affinity(current, 0);
+  on_each_cpu(vmxoffCpu, NULL, 1);
 	if (deallocate_vmxon_region()) {
 		printk(KERN_INFO "Successfully freed allocated vmxon region!\n");
 	}
 	else {
 		printk(KERN_INFO "Error freeing allocated vmxon region!\n");
 	}
-	if (deallocate_vmcs_region()) {
-		printk(KERN_INFO "Successfully freed allocated vmcs region!\n");
-	}
-	else {
-		printk(KERN_INFO "Error freeing allocated vmcs region!\n");
-	}
-	if (deallocate_guest_memory()) {
-		printk(KERN_INFO "Successfully freed guest memory!\n");
-	}
-	else {
-		printk(KERN_INFO "Error freeing guest memory!\n");
-	}
-	asm volatile ("vmxoff\n" : : : "cc");
 	return true;
 }
 
-uint64_t init_ept(void) {
-    
-    cpu.vm_memory = kzalloc(MYPAGE_SIZE*512, GFP_KERNEL);
-    // Allocate EPT structures
-    cpu.pml4 = (EPT_PML4_ENTRY*)kzalloc(MYPAGE_SIZE, GFP_KERNEL); // 1 page for PML4
-    cpu.pml3 = (EPT_PML3_ENTRY*)kzalloc(MYPAGE_SIZE, GFP_KERNEL); // 1 page for PDPT
-    cpu.pml2 = (EPT_PML2_ENTRY*)kzalloc(MYPAGE_SIZE, GFP_KERNEL);   // 1 page for PD
-    cpu.pml1 = (EPT_PML1_ENTRY*)kzalloc(MYPAGE_SIZE*512, GFP_KERNEL);   // 1 page for PD
-
-    printk(KERN_INFO "VMX: pml4 %pK %llx\n", cpu.pml4, (unsigned long long)virt_to_phys(cpu.pml4));
-    printk(KERN_INFO "VMX: pml3 %pK %llx\n", cpu.pml3, (unsigned long long)virt_to_phys(cpu.pml3));
-    printk(KERN_INFO "VMX: pml2 %pK %llx\n", cpu.pml2, (unsigned long long)virt_to_phys(cpu.pml2));
-    printk(KERN_INFO "VMX: pml1 %pK %llx\n", cpu.pml1, (unsigned long long)virt_to_phys(cpu.pml1));
-    printk(KERN_INFO "VMX: vm_memory %pK %llx\n", cpu.vm_memory, (unsigned long long)virt_to_phys(cpu.vm_memory));
-
-    // Setup EPT hierarchy
-    cpu.pml4[0].Fields.PhysicalAddress = virt_to_phys(cpu.pml3) >> 12;
-    cpu.pml4[0].Fields.Read = 1;
-    cpu.pml4[0].Fields.Write = 1;
-    cpu.pml4[0].Fields.Execute = 1;
-
-    for (int i = 0; i < 512; i++) {
-      cpu.pml3[i].Fields.PhysicalAddress = virt_to_phys(cpu.pml2) >> 12;
-      cpu.pml3[i].Fields.Read = 1;
-      cpu.pml3[i].Fields.Write = 1;
-      cpu.pml3[i].Fields.Execute = 1;
-    }
+// EPT tables are allocated under mem_lock, often on the VM-exit path, so
+// always atomically. They come from the node of the CPU running the vCPU,
+// which is the one walking them.
+static void* ept_alloc_table(void) {
+  return pool_alloc(POOL_PAGE, numa_node_id(), GFP_ATOMIC | __GFP_ZERO);
+}
+
+static void ept_free_table(void* table) {
+  pool_free(POOL_PAGE, table);
+}
+
+static uint64_t ept_table_pa(void* table) {
+  return virt_to_phys(table);
+}
+
+static void* ept_table_va(uint64_t pa) {
+  return phys_to_virt(pa);
+}
+
+static const struct paging_ops ept_ops = {
+  .alloc_table = ept_alloc_table,
+  .free_table = ept_free_table,
+  .table_pa = ept_table_pa,
+  .table_va = ept_table_va,
+};
+
+// order-9 blocks are 2MB aligned, which a 2MB EPT leaf requires
+uint8_t* alloc_guest_chunk(int node, gfp_t gfp) {
+  return pool_alloc(POOL_CHUNK, node, gfp | __GFP_ZERO);
+}
+
+void free_guest_chunk(uint8_t* chunk) {
+  pool_free(POOL_CHUNK, chunk);
+}
+
+// Map a backed chunk in the EPT, called with mem_lock held. While a
+// snapshot exists guest RAM is mapped read-only with 4K leaves, so the first
+// guest write to every page exits and gets recorded, see mark_page_dirty().
+// PML logs a large page only once, so a dirty-logged VM uses 4K leaves too.
+static bool map_guest_chunk(struct vcpu* vcpu, uint64_t base, uint8_t* chunk) {
+  bool tracked = vcpu->snapshot;
+
+  return ept_map_range(&ept_ops, vcpu->pml4, base, virt_to_phys(chunk),
+                       min_t(uint64_t, GUEST_CHUNK_SIZE, vcpu->vm_memory_size - base),
+                       tracked || vcpu->pml_log ? 0 : vmx_ept_vpid_caps, !tracked);
+}
+
+// The image's copy of the 2MB region at gpa, NULL if no shared image
+// covers it
+static const uint8_t* image_chunk(struct vcpu* vcpu, uint64_t gpa) {
+  struct shared_image* img = READ_ONCE(vcpu->image);
+
+  if (!img || gpa < vcpu->image_gpa || gpa - vcpu->image_gpa >= img->size)
+    return NULL;
+  return img->chunks[(gpa - vcpu->image_gpa) / GUEST_CHUNK_SIZE];
+}
+
+// Called with mem_lock held before the region at base is backed. In a 1GB
+// window still linked to the image's page directory, the new leaf would
+// show up in every VM sharing it, so the window gets a private copy of the
+// directory first; the other regions keep reading the image through it.
+// Then the region's read-only image leaf, if any, is dropped for
+// map_guest_chunk() to replace.
+static bool unshare_image_region(struct vcpu* vcpu, uint64_t base) {
+  struct shared_image* img = vcpu->image;
+  uint64_t offset = base - vcpu->image_gpa;
+  uint64_t window = offset / GUEST_PAGE_SIZE_1GB;
+  EPT_PML2_ENTRY* pd;
+
+  if (!img || base < vcpu->image_gpa || offset >= round_up(img->size, GUEST_PAGE_SIZE_1GB))
+    return true;
+  if (vcpu->shared_windows & BIT_ULL(window)) {
+    pd = ept_alloc_table();
+    if (!pd)
+      return false;
+    memcpy(pd, img->pds[window], MYPAGE_SIZE);
+    // the PDPT is there and the entry was just cleared, so this cannot fail
+    ept_unlink_pd(&ept_ops, vcpu->pml4, base);
+    ept_link_pd(&ept_ops, vcpu->pml4, base, pd);
+    vcpu->shared_windows &= ~BIT_ULL(window);
+    vcpu->tlb_dirty = true;
+  }
+  pd = ept_pd(&ept_ops, vcpu->pml4, base);
+  if (pd && ((EPT_PML2_2MB_ENTRY*)&pd[EPT_PML2_INDEX(base)])->Fields.LargePage) {
+    pd[EPT_PML2_INDEX(base)].All = 0;
+    vcpu->stats.shared_bytes -= GUEST_CHUNK_SIZE;
+    vcpu->tlb_dirty = true;
+  }
+  return true;
+}
 
-    for (int i = 0; i < 512; i++) {
-      cpu.pml2[i].Fields.PhysicalAddress = virt_to_phys(cpu.pml1 + i*512) >> 12;
-      cpu.pml2[i].Fields.Read = 1;
-      cpu.pml2[i].Fields.Write = 1;
-      cpu.pml2[i].Fields.Execute = 1;
+// Back the 2MB guest region containing gpa with memory and map it in the
+// EPT. A region needs at most one new table per level and every table is
+// allocated before its leaves are written, so a failure leaves no leaf
+// pointing at the freed chunk. A region of a shared image starts as a copy
+// of it, made before taking mem_lock since the image never changes.
+//
+// Callers are the ioctls, the VM-exit path (interrupts off) and the mmap
+// fault handler, which cannot take vcpu->lock. The chunk is allocated with
+// the caller's gfp before taking mem_lock; EPT tables are allocated under
+// it and therefore atomically.
+bool populate_guest_region(struct vcpu* vcpu, uint64_t gpa, gfp_t gfp) {
+  uint64_t index = gpa / GUEST_CHUNK_SIZE;
+  uint64_t base = index * GUEST_CHUNK_SIZE;
+  const uint8_t* image;
+  uint8_t* chunk;
+
+  if (READ_ONCE(vcpu->vm_chunks[index]))
+    return true;
+  image = image_chunk(vcpu, base);
+
+  spin_lock(&vcpu->mem_lock);
+  chunk = vcpu->spare_chunk;
+  vcpu->spare_chunk = NULL;
+  spin_unlock(&vcpu->mem_lock);
+  if (!chunk)
+    chunk = alloc_guest_chunk(vcpu->node, gfp);
+  if (!chunk)
+    return false;
+  if (image)
+    memcpy(chunk, image, GUEST_CHUNK_SIZE);
+
+  spin_lock(&vcpu->mem_lock);
+  if (vcpu->vm_chunks[index]) {
+    // lost a race with another populater, keep ours as the spare unless
+    // it is no longer zeroed
+    if (!vcpu->spare_chunk && !image) {
+      vcpu->spare_chunk = chunk;
+      chunk = NULL;
     }
+    spin_unlock(&vcpu->mem_lock);
+    free_guest_chunk(chunk);
+    return true;
+  }
+  // an image mapped since the copy above was skipped
+  if (!image && image_chunk(vcpu, base)) {
+    image = image_chunk(vcpu, base);
+    memcpy(chunk, image, GUEST_CHUNK_SIZE);
+  }
+  if (!unshare_image_region(vcpu, base) || !map_guest_chunk(vcpu, base, chunk)) {
+    spin_unlock(&vcpu->mem_lock);
+    free_guest_chunk(chunk);
+    return false;
+  }
+  WRITE_ONCE(vcpu->vm_chunks[index], chunk);
+  vcpu->stats.resident_bytes += GUEST_CHUNK_SIZE;
+  if (image)
+    vcpu->stats.cow_chunks++;
+  spin_unlock(&vcpu->mem_lock);
+  return true;
+}
 
-    for (int i = 0; i < 512*512; i++) {
-      cpu.pml1[i].Fields.PhysicalAddress = virt_to_phys(cpu.vm_memory + i*0x1000) >> 12;
-      cpu.pml1[i].Fields.Read = 1;
-      cpu.pml1[i].Fields.Write = 1;
-      cpu.pml1[i].Fields.Execute = 1;
-      cpu.pml1[i].Fields.EPTMemoryType = 0;
+// Guest memory starts out unbacked; regions are populated by
+// populate_guest_region() when the host writes them or the guest faults.
+uint64_t init_ept(struct vcpu* vcpu) {
+    
+    vcpu->vm_chunks = kvcalloc(DIV_ROUND_UP(vcpu->vm_memory_size, GUEST_CHUNK_SIZE),
+                             sizeof(*vcpu->vm_chunks), GFP_KERNEL);
+    vcpu->pml4 = pool_alloc(POOL_PAGE, vcpu->node, GFP_KERNEL | __GFP_ZERO); // 1 page for PML4
+    if (!vcpu->vm_chunks || !vcpu->pml4) {
+      printk(KERN_INFO "VMX: failed allocating guest memory or EPT\n");
+      return 0;
     }
 
-    return virt_to_phys(cpu.pml4);
-}
-
-void setup_guest_page_tables(void* page_table_addr) {
-    guest_page_table_entry *pml4 = (guest_page_table_entry*)(page_table_addr+0x10000);
-    guest_page_table_entry *pdpt = (guest_page_table_entry*)(page_table_addr+0x11000);
-    guest_page_table_entry *pd   = (guest_page_table_entry*)(page_table_addr+0x12000);
-
-    // PML4 at GPA 0x10000
-    pml4[0].PhysicalAddress = 0x11000 >> 12; // Point to PDPT
-    pml4[0].Present = 1;
-    pml4[0].ReadWrite = 1;
-
-    // PDPT at GPA 0x11000
-    pdpt[0].PhysicalAddress = 0x12000 >> 12; // Point to PD
-    pdpt[0].Present = 1;
-    pdpt[0].ReadWrite = 1;
-    pdpt[0].UserSupervisor = 1;
-
-    pd[0].PhysicalAddress = 0; //(0 * 0x200000LL) >> 12;
-    pd[0].Present = 1;
-    pd[0].ReadWrite = 1;
-    pd[0].UserSupervisor = 1;
-    pd[0].PageSize = 1; // 2MB page
-    pd[0].CacheDisable = 0;
-    pd[0].NoExecute = 0;
-
-    // PD at GPA 0x12000, map GVA 0x0 to GPA 0x0 (2MB page)
-    //for (int i = 0; i < 512; i++) {
-    //  pd[i].PhysicalAddress = (i*0x200000LL) >> 12;
-    //  pd[i].Present = 1;
-    //  pd[i].ReadWrite = 1;
-    //  pd[i].UserSupervisor = 1;
-    //  pd[i].PageSize = 1; // 2MB page
-    //  pd[i].CacheDisable = 0;
-    //  pd[i].NoExecute = 0;
-    //}
+    printk(KERN_INFO "VMX: pml4 %pK %llx\n", vcpu->pml4, (unsigned long long)virt_to_phys(vcpu->pml4));
+
+    return virt_to_phys(vcpu->pml4);
+}
+
+// The tables live in the first guest chunk, which create_vm() populated
+bool setup_guest_page_tables(struct vcpu* vcpu) {
+  if (!guest_build_page_tables(vcpu->vm_chunks[0], vcpu->vm_memory_size,
+                               boot_cpu_has(X86_FEATURE_GBPAGES))) {
+    printk(KERN_INFO "VMX: guest page tables for 0x%llx bytes do not fit below 0x%x\n",
+           (unsigned long long)vcpu->vm_memory_size, GUEST_PAGE_TABLES_END);
+    return false;
+  }
+  return true;
+}
+
+// the EPT itself was built by init_ept() before the VMCS was loaded
+static uint64_t build_eptp(struct vcpu* vcpu) {
+  EPTP eptp = {0};
+
+  eptp.Fields.PML4Address = virt_to_phys(vcpu->pml4) >> 12;
+  eptp.Fields.MemoryType = EPT_MEMORY_TYPE_WB; // paging-structure accesses are write-back
+  eptp.Fields.PageWalkLength = 3;
+  eptp.Fields.DirtyAndAccessEnabled = !!(vmx_ept_vpid_caps & VMX_EPT_AD_BIT);
+  return eptp.All;
+}
+
+static void template_add(uint32_t field, uint64_t value) {
+  BUG_ON(vmcs_template_len >= VMCS_TEMPLATE_MAX);
+  vmcs_template[vmcs_template_len].field = field;
+  vmcs_template[vmcs_template_len].value = value;
+  vmcs_template_len++;
+}
+
+// CH 26.2 and 26.3, Vol 3: the VMCS fields every VM starts with, as
+// initVmcsControlFieldLegacy() sets them, computed without a VMCS. The
+// host state of a CPU (GS, TR and GDTR bases, SYSENTER_ESP) and of a task
+// (CR3, FS base, CR4) is written by refresh_host_cpu_state() and
+// refresh_host_state() instead. Fields the controls leave unused (the
+// guest EFER, PAT and PERF_GLOBAL_CTRL, which are not loaded on entry,
+// interrupt status and the preemption timer, armed before each run) are
+// not written at all.
+static void build_vmcs_template(void) {
+  uint64_t pin = __rdmsr1(MSR_IA32_VMX_PINBASED_CTLS);
+  uint64_t proc = __rdmsr1(MSR_IA32_VMX_PROCBASED_CTLS);
+  uint64_t proc2 = __rdmsr1(MSR_IA32_VMX_PROCBASED_CTLS2);
+  uint32_t pin_final = pin & (pin >> 32);
+  uint32_t proc_final = (proc & (proc >> 32)) | ACTIVATE_SECONDARY_CONTROLS | CPU_BASED_HLT_EXITING;
+  uint64_t host_cr0 = get_cr0();
+  uint16_t es = get_es1(), cs = get_cs1(), ss = get_ss1(), ds = get_ds1();
+  uint16_t fs = get_fs1(), gs = get_gs1(), tr = get_tr1();
+  uint64_t sysenter_esp = __rdmsr1(MSR_IA32_SYSENTER_ESP);
+  uint64_t sysenter_eip = __rdmsr1(MSR_IA32_SYSENTER_EIP);
+  uint64_t sysenter_cs = __rdmsr(MSR_IA32_SYSENTER_CS);
+
+  // host interrupts and NMIs end the guest's turn instead of going
+  // through the guest's IDT
+  pin_final |= PIN_BASED_EXT_INTR_MASK | PIN_BASED_NMI_EXITING;
+  if (preemption_timer_supported)
+    pin_final |= PIN_BASED_VMX_PREEMPTION_TIMER;
+  if ((proc >> 32) & CPU_BASED_USE_IO_BITMAPS)
+    proc_final |= CPU_BASED_USE_IO_BITMAPS;
+  else
+    proc_final |= CPU_BASED_UNCOND_IO_EXITING;
+  if ((proc >> 32) & CPU_BASED_USE_MSR_BITMAPS)
+    proc_final |= CPU_BASED_USE_MSR_BITMAPS;
+  vmcs_proc2_template = (proc2 & (proc2 >> 32)) | (1 << 1); // EPT
+
+  vmcs_template_len = 0;
+  template_add(PIN_BASED_VM_EXEC_CONTROLS, pin_final);
+  template_add(PROC_BASED_VM_EXEC_CONTROLS, proc_final);
+  template_add(VM_EXIT_CONTROLS, (uint32_t)__rdmsr1(MSR_IA32_VMX_EXIT_CTLS) |
+               VM_EXIT_HOST_ADDR_SPACE_SIZE);
+  template_add(VM_ENTRY_CONTROLS, (uint32_t)__rdmsr1(MSR_IA32_VMX_ENTRY_CTLS) |
+               VM_ENTRY_IA32E_MODE);
+  // only #NM exits, to load the guest FPU state, see guest_fpu_load()
+  template_add(EXCEPTION_BITMAP, 1 << NM_VECTOR);
+
+  template_add(HOST_CR0, host_cr0);
+  template_add(HOST_ES_SELECTOR, es);
+  template_add(HOST_CS_SELECTOR, cs);
+  template_add(HOST_SS_SELECTOR, ss);
+  template_add(HOST_DS_SELECTOR, ds);
+  template_add(HOST_FS_SELECTOR, fs);
+  template_add(HOST_GS_SELECTOR, gs);
+  template_add(HOST_TR_SELECTOR, tr);
+  template_add(HOST_IDTR_BASE, get_idt_base1());
+  template_add(HOST_IA32_SYSENTER_EIP, sysenter_eip);
+  template_add(HOST_IA32_SYSENTER_CS, sysenter_cs);
+
+  template_add(GUEST_ES_SELECTOR, es);
+  template_add(GUEST_CS_SELECTOR, cs);
+  template_add(GUEST_SS_SELECTOR, ss);
+  template_add(GUEST_DS_SELECTOR, ds);
+  template_add(GUEST_FS_SELECTOR, fs);
+  template_add(GUEST_GS_SELECTOR, gs);
+  template_add(GUEST_LDTR_SELECTOR, 0);
+  template_add(GUEST_TR_SELECTOR, tr);
+  template_add(VMCS_LINK_POINTER, -1ll);
+  template_add(GUEST_IA32_DEBUGCTL, 0);
+  template_add(GUEST_ES_LIMIT, 0xffffffff);
+  template_add(GUEST_CS_LIMIT, 0xffffffff);
+  template_add(GUEST_SS_LIMIT, 0xffffffff);
+  template_add(GUEST_DS_LIMIT, 0xffffffff);
+  template_add(GUEST_FS_LIMIT, 0xffffffff);
+  template_add(GUEST_GS_LIMIT, 0xffffffff);
+  template_add(GUEST_LDTR_LIMIT, 0xffffffff);
+  template_add(GUEST_TR_LIMIT, 0x67);
+  template_add(GUEST_GDTR_LIMIT, 0xffff);
+  template_add(GUEST_IDTR_LIMIT, 0xffff);
+  template_add(GUEST_ES_AR_BYTES, es == 0 ? 0x10000 : 0xc093);
+  template_add(GUEST_CS_AR_BYTES, 0xa09b);
+  template_add(GUEST_SS_AR_BYTES, 0xc093);
+  template_add(GUEST_DS_AR_BYTES, ds == 0 ? 0x10000 : 0xc093);
+  template_add(GUEST_FS_AR_BYTES, fs == 0 ? 0x10000 : 0xc093);
+  template_add(GUEST_GS_AR_BYTES, gs == 0 ? 0x10000 : 0xc093);
+  template_add(GUEST_LDTR_AR_BYTES, 0x10000);
+  template_add(GUEST_TR_AR_BYTES, 0x8b);
+  template_add(GUEST_INTERRUPTIBILITY_INFO, 0);
+  template_add(GUEST_ACTIVITY_STATE, 0);
+  template_add(GUEST_SYSENTER_CS, sysenter_cs);
+  template_add(GUEST_SYSENTER_ESP, sysenter_esp);
+  template_add(GUEST_SYSENTER_EIP, sysenter_eip);
+
+  // CH 25.3, Vol 3: the host owns CR0.TS, see initVmcsControlFieldLegacy()
+  template_add(CR0_GUEST_HOST_MASK, CR0_TS);
+  template_add(CR0_READ_SHADOW, host_cr0 & ~CR0_TS);
+  template_add(GUEST_CR0, host_cr0 | CR0_TS);
+  template_add(GUEST_CR3, GUEST_PAGE_TABLES);
+  // the guest has no use for the host's per-task and per-CPU bases, only
+  // their selectors need valid (canonical) bases
+  template_add(GUEST_ES_BASE, 0);
+  template_add(GUEST_CS_BASE, 0);
+  template_add(GUEST_SS_BASE, 0);
+  template_add(GUEST_DS_BASE, 0);
+  template_add(GUEST_FS_BASE, 0);
+  template_add(GUEST_GS_BASE, 0);
+  template_add(GUEST_LDTR_BASE, 0);
+  template_add(GUEST_TR_BASE, get_desc64_base((struct desc64 *)(get_gdt_base1() + tr)));
+  template_add(GUEST_GDTR_BASE, get_gdt_base1());
+  template_add(GUEST_IDTR_BASE, get_idt_base1());
 }
 
 // Initializing VMCS control field
-bool initVmcsControlField(void) {
+static bool initVmcsControlFieldLegacy(struct vcpu* vcpu) {
 	// checking of any of the default1 controls may be 0:
 	//not doing it for now.
 
@@ -275,6 +790,9 @@ bool initVmcsControlField(void) {
 
 	// setting final value to write to control fields
 	uint32_t pinbased_control_final = (pinbased_control0 & pinbased_control1);
+  pinbased_control_final |= PIN_BASED_EXT_INTR_MASK | PIN_BASED_NMI_EXITING;
+  if (preemption_timer_supported)
+    pinbased_control_final |= PIN_BASED_VMX_PREEMPTION_TIMER;
 	uint32_t procbased_control_final = (procbased_control0 & procbased_control1);
 	uint32_t procbased_secondary_control_final = (procbased_secondary_control0 & procbased_secondary_control1);
 	uint32_t host_address_space = 1 << 9;
@@ -299,7 +817,20 @@ bool initVmcsControlField(void) {
 	
   uint64_t enabling_ept = 1 << 1;
 	procbased_control_final = procbased_control_final | ACTIVATE_SECONDARY_CONTROLS;
+  // HLT ends a run. Port I/O and MSR accesses exit as the bitmaps say;
+  // without bitmap support all port I/O exits.
+  procbased_control_final |= CPU_BASED_HLT_EXITING;
+  if (procbased_control1 & CPU_BASED_USE_IO_BITMAPS)
+    procbased_control_final |= CPU_BASED_USE_IO_BITMAPS;
+  else
+    procbased_control_final |= CPU_BASED_UNCOND_IO_EXITING;
+  if (procbased_control1 & CPU_BASED_USE_MSR_BITMAPS)
+    procbased_control_final |= CPU_BASED_USE_MSR_BITMAPS;
 	procbased_secondary_control_final = procbased_secondary_control_final | enabling_ept;
+  if (vcpu->vpid)
+    procbased_secondary_control_final |= SECONDARY_EXEC_ENABLE_VPID;
+  if (vcpu->pml_log)
+    procbased_secondary_control_final |= SECONDARY_EXEC_ENABLE_PML;
 
 	// writing the value to control field
 	vmwrite(PIN_BASED_VM_EXEC_CONTROLS, pinbased_control_final);
@@ -307,11 +838,15 @@ bool initVmcsControlField(void) {
 	vmwrite(PROC2_BASED_VM_EXEC_CONTROLS, procbased_secondary_control_final);
 	vmwrite(VM_EXIT_CONTROLS, vm_exit_control_final);
 	vmwrite(VM_ENTRY_CONTROLS, vm_entry_control_final);
-	// to ignore the guest exception
-	// maybe optional
-	vmwrite(EXCEPTION_BITMAP, 0);
+	// only #NM exits, to load the guest FPU state, see guest_fpu_load()
+	vmwrite(EXCEPTION_BITMAP, 1 << NM_VECTOR);
 
-	vmwrite(VIRTUAL_PROCESSOR_ID, 0);
+	vmwrite(VIRTUAL_PROCESSOR_ID, vcpu->vpid);
+  vmwrite(IO_BITMAP_A, virt_to_phys(vcpu->io_bitmap_a));
+  vmwrite(IO_BITMAP_B, virt_to_phys(vcpu->io_bitmap_b));
+  vmwrite(MSR_BITMAP, virt_to_phys(vcpu->msr_bitmap));
+  if (vcpu->pml_log)
+    vmwrite(PML_ADDRESS, virt_to_phys(vcpu->pml_log));
 
 	vmwrite(VM_EXIT_CONTROLS, __rdmsr1(MSR_IA32_VMX_EXIT_CTLS) |
 		VM_EXIT_HOST_ADDR_SPACE_SIZE);
@@ -323,6 +858,7 @@ bool initVmcsControlField(void) {
 	vmwrite(HOST_CR0, get_cr0());
 	vmwrite(HOST_CR3, get_cr3());
 	vmwrite(HOST_CR4, get_cr4());
+  vcpu->host_cr4 = get_cr4();
 
 	//setting host selectors fields
 	vmwrite(HOST_ES_SELECTOR, get_es1());
@@ -352,7 +888,7 @@ bool initVmcsControlField(void) {
 	vmwrite(GUEST_LDTR_SELECTOR, 0);
 	vmwrite(GUEST_TR_SELECTOR, vmreadz(HOST_TR_SELECTOR));
 	vmwrite(GUEST_INTR_STATUS, 0);
-	vmwrite(GUEST_PML_INDEX, 0);
+	vmwrite(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
 
 	vmwrite(VMCS_LINK_POINTER, -1ll);
 	vmwrite(GUEST_IA32_DEBUGCTL, 0);
@@ -388,10 +924,14 @@ bool initVmcsControlField(void) {
 	vmwrite(GUEST_SYSENTER_CS, vmreadz(HOST_IA32_SYSENTER_CS));
 	vmwrite(VMX_PREEMPTION_TIMER_VALUE, 0);
 
-  uint64_t guest_cr0 = vmreadz(HOST_CR0); 
+  uint64_t guest_cr0 = vmreadz(HOST_CR0) & ~CR0_TS;
   //guest_cr0 = (1UL << 0) | (1UL << 31);
-	vmwrite(GUEST_CR0, guest_cr0);
-	vmwrite(GUEST_CR3, 0x10000); //vmreadz(HOST_CR3));
+  // CH 25.3, Vol 3: the host owns CR0.TS and sets it until the guest FPU
+  // state is loaded; the guest reads it as clear
+  vmwrite(CR0_GUEST_HOST_MASK, CR0_TS);
+  vmwrite(CR0_READ_SHADOW, guest_cr0);
+	vmwrite(GUEST_CR0, guest_cr0 | CR0_TS);
+	vmwrite(GUEST_CR3, GUEST_PAGE_TABLES); //vmreadz(HOST_CR3));
 	vmwrite(GUEST_CR4, vmreadz(HOST_CR4));
 	vmwrite(GUEST_ES_BASE, 0);
 	vmwrite(GUEST_CS_BASE, 0);
@@ -407,50 +947,78 @@ bool initVmcsControlField(void) {
 	vmwrite(GUEST_SYSENTER_ESP, vmreadz(HOST_IA32_SYSENTER_ESP));
 	vmwrite(GUEST_SYSENTER_EIP, vmreadz(HOST_IA32_SYSENTER_EIP));
 	// setting up rip and rsp for guest
-	void *costum_rip;
-	void *costum_rsp;
+	reset_guest_entry_state(vcpu);
 
-	costum_rsp = (void*)0x1000;
-	costum_rip = 0;
-	vmwrite(GUEST_RSP, (uint64_t)costum_rsp);
-	vmwrite(GUEST_RIP, (uint64_t)costum_rip);
+  vcpu->eptp = build_eptp(vcpu);
+  printk(KERN_INFO "VMX: main_ept: %llx", (unsigned long long)vcpu->eptp);
+  vmwrite(EPT_POINTER, vcpu->eptp);
 
-  EPTP eptp = {0};
-  uint64_t pml4_phys = init_ept();
-  eptp.Fields.PML4Address = pml4_phys >> 12;
-  eptp.Fields.MemoryType = 6; // uncached
-  eptp.Fields.PageWalkLength = 3;
-  eptp.Fields.DirtyAndAccessEnabled = 1;
+	return true;
+}
+
+// Everything that differs between VMs, or that the host may change while
+// the module is loaded (CR4), on top of vmcs_template. The host state of
+// the CPU and task is written by vcpu_load() and before every run.
+bool initVmcsControlField(struct vcpu* vcpu) {
+  uint32_t proc2 = vmcs_proc2_template;
+  uint64_t start = rdtsc();
+  uint64_t host_cr4 = get_cr4();
+
+  if (unlikely(legacy_vmcs_setup)) {
+    initVmcsControlFieldLegacy(vcpu);
+    vcpu->stats.vmcs_setup_cycles = rdtsc() - start;
+    return true;
+  }
 
-  printk(KERN_INFO "VMX: main_ept: %llx", (unsigned long long)eptp.All);
-  vmwrite(EPT_POINTER, eptp.All);
-  setup_guest_page_tables(cpu.vm_memory);
+  for (unsigned int i = 0; i < vmcs_template_len; i++)
+    vmwrite(vmcs_template[i].field, vmcs_template[i].value);
 
-	return true;
+  if (vcpu->vpid) {
+    proc2 |= SECONDARY_EXEC_ENABLE_VPID;
+    vmwrite(VIRTUAL_PROCESSOR_ID, vcpu->vpid);
+  }
+  if (vcpu->pml_log) {
+    proc2 |= SECONDARY_EXEC_ENABLE_PML;
+    vmwrite(PML_ADDRESS, virt_to_phys(vcpu->pml_log));
+    vmwrite(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+  }
+  vmwrite(PROC2_BASED_VM_EXEC_CONTROLS, proc2);
+  vmwrite(IO_BITMAP_A, virt_to_phys(vcpu->io_bitmap_a));
+  vmwrite(IO_BITMAP_B, virt_to_phys(vcpu->io_bitmap_b));
+  vmwrite(MSR_BITMAP, virt_to_phys(vcpu->msr_bitmap));
+  vmwrite(HOST_CR4, host_cr4);
+  vcpu->host_cr4 = host_cr4;
+  vmwrite(GUEST_CR4, host_cr4);
+  reset_guest_entry_state(vcpu);
+  vcpu->eptp = build_eptp(vcpu);
+  vmwrite(EPT_POINTER, vcpu->eptp);
+  vcpu->stats.vmcs_setup_cycles = rdtsc() - start;
+  return true;
 }
 
-uint32_t vmresume(void) {
+// Move guest RIP past the instruction that caused the exit
+bool skip_guest_instruction(void) {
   uint64_t insn_length;
   uint64_t guest_rip;
   uint32_t status = vmread(VMX_VMEXIT_INSTRUCTION_LENGTH, &insn_length);
   if (status) {
     printk(KERN_INFO "VMX: failed adjusting");
-    return 1;
+    return false;
   }
 
   status = vmread(GUEST_RIP, &guest_rip);
   if (status) {
     printk(KERN_INFO "VMX: failed adjusting");
-    return 1;
+    return false;
   }
 
   vmwrite(GUEST_RIP, guest_rip+insn_length);
+  return true;
+}
 
-  restore_regs(&cpu.guest_gen_regs);
-  __asm__ __volatile__ (
-      "xorq %rdi, %rdi;"
-      "vmresume;"
-  );
+// Only returns if VMRESUME failed
+uint32_t vmresume(struct vcpu* vcpu) {
+  _vmresume(&vcpu->guest_gen_regs);
   return 0;
 }
 
@@ -479,189 +1047,1958 @@ inline void info(void) {
            guest_rip, guest_rsp, guest_cr3, guest_cr0);
 }
 
-void vmexit_handler(void) {
-  save_regs(&cpu.guest_gen_regs);
-  uint32_t exit_reason = vmExit_reason();
-  printk(KERN_INFO "VMX: vmexit_handler called: 0x%x 0x%llx\n", exit_reason, vmreadz(GUEST_RIP));
-  info();
-
-  uint64_t rax = cpu.guest_gen_regs.rax;
-  uint64_t rbx = cpu.guest_gen_regs.rbx;
-  switch (exit_reason) {
-    case vmexit_vmcall:
-      printk(KERN_INFO "VMX: vmcall or cpuid, RAX: 0x%llx\n", rax);
-      switch (rax) {
-        case 1:
-          printk(KERN_INFO "Integer: 0x%llx\n", rbx);
-          break;
-        default:
-          break;
-      }
-      break;
-    default:
-      restore_regs(&cpu.host_gen_regs);
-      return;
-  }
-  if (!vmresume()) {
-    restore_regs(&cpu.host_gen_regs);
+// CH 28.3.3.2, Vol 3
+// An EPT violation inside guest memory on a region that has no backing yet
+// is a demand fault: populate the region and retry the access. With a
+// snapshot, a backed region may be unmapped or write-protected instead.
+// A guest write to a region it reads from a shared image lands here too,
+// and copies the region. Without a snapshot, a backed region only faults
+// through a translation that was stale when it was populated or copied
+// meanwhile, by the mmap() fault handler or for the image; the guest
+// retries after the flush before resuming.
+// The exit path runs with interrupts off, so allocations here must be atomic.
+bool handle_ept_violation(struct vcpu* vcpu) {
+  uint64_t gpa = vmreadz(GUEST_PHYSICAL_ADDRESS);
+
+  if (gpa >= vcpu->vm_memory_size)
+    return false;
+  if (vcpu->vm_chunks[gpa / GUEST_CHUNK_SIZE]) {
+    if (!vcpu->snapshot) {
+      vcpu->tlb_dirty = true;
+      return true;
+    }
+    if (!(vmreadz(EXIT_QUALIFICATION) & EPT_VIOLATION_WRITE))
+      return map_snapshot_chunk(vcpu, gpa);
+    return mark_page_dirty(vcpu, gpa, false);
   }
+  if (!populate_guest_region(vcpu, gpa, GFP_ATOMIC))
+    return false;
+  vcpu->stats.demand_faults++;
+  return true;
 }
 
-bool initVmLaunchProcess(void) {
-  set_cpu_affinity(current, 0);
-	_vmlaunch(&cpu.host_gen_regs, (uint64_t)vmexit_handler);
-	printk(KERN_INFO "VM exit reason is %lu!\n", (unsigned long)vmExit_reason());
-  memset(&cpu.guest_gen_regs, 0, sizeof(gen_regs));
-	return true;
-}
+static inline void account_exit(uint32_t exit_reason, uint64_t start) {
+  struct proto_exit_stats* stats = this_cpu_ptr(&exit_stats);
 
-static long int proto_ioctl(struct file* file, uint32_t cmd, unsigned long arg) {
-  int ret;
-  unsigned long flags;
+  if (exit_reason >= PROTO_EXIT_REASONS)
+    return;
+  stats->count[exit_reason]++;
+  stats->cycles[exit_reason] += rdtsc() - start;
+}
 
-  set_cpu_affinity(current, 0);
-  ret = mutex_lock_interruptible(&vmx_mutex);
-  if (ret) {
-    pr_err("Mutex lock failed: %d\n", ret);
-    return ret;
-  }
-	if (!vmcsOperations()) {
-		printk(KERN_INFO "VMCS Allocation failed! EXITING");
-    mutex_unlock(&vmx_mutex);
-		return 0;
-	}
-	else {
-		printk(KERN_INFO "VMCS Allocation succeeded! CONTINUING");
-	}
-	if (!initVmcsControlField()) {
-		printk(KERN_INFO "Initialization of VMCS Control field failed! EXITING");
-    mutex_unlock(&vmx_mutex);
-		return 0;
-	}
-	else {
-		printk(KERN_INFO "Initializing of control fields to the most basic settings succeeded! CONTINUING");
-	}
-  if (copy_from_user(cpu.vm_memory, (void*)arg, 0x5000)) {
-    mutex_unlock(&vmx_mutex);
-    return -ENOENT;
-  }
+// Host address of [gpa, gpa+len) if it is backed. The range must not cross
+// a 2MB region, since regions are not contiguous in host memory.
+static void* guest_hva(struct vcpu* vcpu, uint64_t gpa, uint64_t len) {
+  uint8_t* chunk;
 
-  local_irq_save(flags);
+  if (gpa >= vcpu->vm_memory_size || len > vcpu->vm_memory_size - gpa ||
+      gpa / GUEST_CHUNK_SIZE != (gpa + len - 1) / GUEST_CHUNK_SIZE)
+    return NULL;
+  chunk = READ_ONCE(vcpu->vm_chunks[gpa / GUEST_CHUNK_SIZE]);
+  return chunk ? chunk + gpa % GUEST_CHUNK_SIZE : NULL;
+}
 
-	if (!initVmLaunchProcess()) {
-		printk(KERN_INFO "VMLAUNCH failed! EXITING");
-    mutex_unlock(&vmx_mutex);
-		return 0;
-	}
-	else {
-		printk(KERN_INFO "VMLAUNCH succeeded! CONTINUING");
-	}
-  deallocate_guest_memory();
-  local_irq_restore(flags);
-  mutex_unlock(&vmx_mutex);
+// guest_hva() for reading only, which also finds the regions the guest
+// still reads from its shared image
+static const void* guest_hva_ro(struct vcpu* vcpu, uint64_t gpa, uint64_t len) {
+  const uint8_t* chunk = guest_hva(vcpu, gpa, len);
 
-  return 0;
+  if (chunk || gpa >= vcpu->vm_memory_size ||
+      gpa / GUEST_CHUNK_SIZE != (gpa + len - 1) / GUEST_CHUNK_SIZE)
+    return chunk;
+  chunk = image_chunk(vcpu, gpa);
+  return chunk ? chunk + gpa % GUEST_CHUNK_SIZE : NULL;
 }
 
-static const struct file_operations my_driver_fops = {
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = proto_ioctl,
-};
-
-int __init start_init(void)
-{
-  int ret;
-  set_cpu_affinity(current, 0);
-  if (!vmxSupport()) {
-		printk(KERN_INFO "VMX support not present! EXITING");
-		return 0;
-	}
-	else {
-		printk(KERN_INFO "VMX support present! CONTINUING");
-	}
-	if (!getVmxOperation()) {
-		printk(KERN_INFO "VMX Operation failed! EXITING");
-		return 0;
-	}
-	else {
-		printk(KERN_INFO "VMX Operation succeeded! CONTINUING");
-	}
-  ret = alloc_chrdev_region(&dev, 0, 1, "protovirt");
-  if (ret < 0) {
-      pr_err("Failed to allocate chrdev region\n");
-      return ret;
+// Hypercalls that may be queued in the ring as well as issued directly
+static long do_hypercall(struct vcpu* vcpu, uint32_t op, uint64_t arg0, uint64_t arg1) {
+  const char* str;
+
+  switch (op) {
+    case PROTO_HC_NOP:
+      return 0;
+    case PROTO_HC_PRINT_INT:
+      printk(KERN_INFO "Integer: 0x%llx\n", arg0);
+      return 0;
+    case PROTO_HC_PRINT_STR:
+      if (arg1 > PROTO_HC_MAX_STR)
+        return -EINVAL;
+      str = guest_hva_ro(vcpu, arg0, arg1);
+      if (!str)
+        return -EFAULT;
+      printk(KERN_INFO "Guest: %.*s\n", (int)arg1, str);
+      return 0;
+    // up to all of guest RAM, too much for the exit path; see
+    // populate_deferred()
+    case PROTO_HC_POPULATE:
+      if (arg0 >= vcpu->vm_memory_size || arg1 > vcpu->vm_memory_size - arg0)
+        return -EINVAL;
+      if (vcpu->populate_end)
+        return -EBUSY;
+      if (arg1) {
+        vcpu->populate_gpa = round_down(arg0, GUEST_CHUNK_SIZE);
+        vcpu->populate_end = arg0 + arg1;
+      }
+      return 0;
+    default:
+      return -ENOSYS;
   }
+}
 
-  my_cdev = cdev_alloc();
-  if (!my_cdev) {
-      unregister_chrdev_region(dev, 1);
-      return -ENOMEM;
+// The guest is stopped while this runs, so head is read once and entries
+// cannot change underneath. At most a ring's worth is processed per kick.
+static void drain_hc_ring(struct vcpu* vcpu) {
+  struct proto_hc_ring* ring = vcpu->hc_ring;
+  uint32_t head = READ_ONCE(ring->head);
+  uint32_t tail = ring->tail;
+
+  if (head >= PROTO_HC_RING_ENTRIES || tail >= PROTO_HC_RING_ENTRIES)
+    return;
+  while (tail != head) {
+    struct proto_hc_entry* entry = &ring->entries[tail];
+
+    entry->result = do_hypercall(vcpu, READ_ONCE(entry->op),
+                                 READ_ONCE(entry->args[0]), READ_ONCE(entry->args[1]));
+    tail = (tail + 1) % PROTO_HC_RING_ENTRIES;
+    vcpu->stats.hypercalls++;
   }
+  WRITE_ONCE(ring->tail, tail);
+}
 
-  cdev_init(my_cdev, &my_driver_fops);
-  my_cdev->owner = THIS_MODULE;
+// Point the console at the ring at gpa, which must lie in one 2MB region,
+// and skip what it already holds. The guest cannot change size afterwards.
+static bool console_attach(struct vcpu* vcpu, uint64_t gpa, gfp_t gfp) {
+  struct proto_console_ring* ring;
+  uint32_t size;
 
-  ret = cdev_add(my_cdev, dev, 1);
-  if (ret < 0) {
-      pr_err("Failed to add cdev\n");
-      cdev_del(my_cdev);
-      unregister_chrdev_region(dev, 1);
-      return ret;
-  }
+  if (!IS_ALIGNED(gpa, 8) || gpa >= vcpu->vm_memory_size ||
+      !populate_guest_region(vcpu, gpa, gfp))
+    return false;
+  ring = guest_hva(vcpu, gpa, sizeof(*ring));
+  if (!ring)
+    return false;
+  size = READ_ONCE(ring->size);
+  if (!is_power_of_2(size) || !guest_hva(vcpu, gpa, sizeof(*ring) + size))
+    return false;
+  spin_lock(&vcpu->console_lock);
+  vcpu->console = ring;
+  vcpu->console_size = size;
+  vcpu->console_tail = READ_ONCE(ring->head);
+  vcpu->stats.console_gpa = gpa;
+  spin_unlock(&vcpu->console_lock);
+  return true;
+}
 
-  my_class = class_create("proto_class");
-  if (IS_ERR(my_class)) {
-      pr_err("Failed to create class: %ld\n", PTR_ERR(my_class));
-      ret = PTR_ERR(my_class);
-      return ret;
+// Print the lines the guest added to its console since the last drain,
+// with console_lock held. The guest may be writing meanwhile: head is read
+// before the bytes, and what it overwrote while they were copied is
+// dropped like anything it lapped. A line still being written waits for
+// the next drain unless flush is set, after a run. The guest sets how much
+// that is, so at most CONSOLE_DRAIN_LINES lines are printed per call, rate
+// limited; returns true if it stopped there.
+static bool drain_console(struct vcpu* vcpu, bool flush) {
+  struct proto_console_ring* ring = vcpu->console;
+  uint32_t mask = vcpu->console_size - 1;
+  char line[PROTO_HC_MAX_STR];
+  uint32_t head, len, n;
+
+  if (!ring || vcpu->user_console)
+    return false;
+  for (uint32_t lines = 0; lines < CONSOLE_DRAIN_LINES; lines++) {
+    head = smp_load_acquire(&ring->head);
+    if (head - vcpu->console_tail > vcpu->console_size) {
+      vcpu->stats.console_dropped += head - vcpu->console_tail - vcpu->console_size;
+      vcpu->console_tail = head - vcpu->console_size;
+    }
+    len = min_t(uint32_t, head - vcpu->console_tail, sizeof(line));
+    for (n = 0; n < len; n++) {
+      line[n] = READ_ONCE(ring->data[(vcpu->console_tail + n) & mask]);
+      if (line[n] == '\n')
+        break;
+    }
+    if (n == len && (!len || (len < sizeof(line) && !flush)))
+      return false;
+    smp_rmb();
+    if (READ_ONCE(ring->head) - vcpu->console_tail > vcpu->console_size)
+      continue;
+    printk_ratelimited(KERN_INFO "Guest: %.*s\n", (int)n, line);
+    // a full line buffer is printed without waiting for its newline
+    n += n < len;
+    vcpu->console_tail += n;
+    vcpu->stats.console_bytes += n;
   }
+  return true;
+}
 
-  // Step 4: Create a device instance (triggers udev)
-  my_device = device_create(my_class, NULL, dev, NULL, "proto");
-  if (IS_ERR(my_device)) {
-      pr_err("Failed to create device: %ld\n", PTR_ERR(my_device));
-      ret = PTR_ERR(my_device);
-      return ret;
+static int console_thread_fn(void* unused) {
+  struct vcpu* vcpu;
+  unsigned int ms;
+
+  while (!kthread_should_stop()) {
+    ms = READ_ONCE(console_poll_ms);
+    if (ms) {
+      mutex_lock(&console_vcpus_lock);
+      list_for_each_entry(vcpu, &console_vcpus, console_node) {
+        spin_lock(&vcpu->console_lock);
+        drain_console(vcpu, false);
+        spin_unlock(&vcpu->console_lock);
+      }
+      mutex_unlock(&console_vcpus_lock);
+    }
+    schedule_timeout_interruptible(msecs_to_jiffies(ms ? ms : MSEC_PER_SEC));
   }
-
-  pr_info("Proto driver initialized\n");
   return 0;
 }
 
-static void __exit end_exit(void)
-{
-  set_cpu_affinity(current, 0);
-  printk(KERN_INFO "Unloading the driver\n");
-  if (!vmxoffOperation()) {
-		printk(KERN_INFO "VMXOFF operation failed! EXITING");
-		return;
-	}
-	else {
-		printk(KERN_INFO "VMXOFF Operation succeeded! CONTINUING\n");
-	}
-  device_destroy(my_class, dev);
-  class_destroy(my_class);
-  cdev_del(my_cdev);
-  unregister_chrdev_region(dev, 1);
-  printk(KERN_INFO "Driver unloaded\n");
-	return;
+bool handle_vmcall(struct vcpu* vcpu) {
+  uint64_t nr = vcpu->guest_gen_regs.rax;
+  uint64_t arg0 = vcpu->guest_gen_regs.rbx;
+  uint64_t arg1 = vcpu->guest_gen_regs.rcx;
+  struct proto_hc_ring* ring;
+
+  BUILD_BUG_ON(sizeof(*ring) != MYPAGE_SIZE);
+  if (unlikely(verbose_exits))
+    printk(KERN_INFO "VMX: vmcall or cpuid, RAX: 0x%llx\n", nr);
+  switch (nr) {
+    case PROTO_HC_RING_SETUP:
+      if (!IS_ALIGNED(arg0, MYPAGE_SIZE) || arg0 >= vcpu->vm_memory_size ||
+          !populate_guest_region(vcpu, arg0, GFP_ATOMIC))
+        break;
+      ring = guest_hva(vcpu, arg0, sizeof(*ring));
+      if (!ring)
+        break;
+      ring->head = 0;
+      ring->tail = 0;
+      vcpu->hc_ring = ring;
+      vcpu->hc_ring_gpa = arg0;
+      mark_page_dirty(vcpu, arg0, true);
+      break;
+    case PROTO_HC_RING_KICK:
+      if (vcpu->hc_ring) {
+        drain_hc_ring(vcpu);
+        mark_page_dirty(vcpu, vcpu->hc_ring_gpa, true);
+      }
+      break;
+    case PROTO_HC_CONSOLE_SETUP:
+      console_attach(vcpu, arg0, GFP_ATOMIC);
+      break;
+    default:
+      do_hypercall(vcpu, nr, arg0, arg1);
+      break;
+  }
+  return skip_guest_instruction();
 }
 
-module_init(start_init);
+// CPUID exits unconditionally. Answer it with the host's values, minus
+// VMX, and report a hypervisor.
+bool handle_cpuid(struct vcpu* vcpu) {
+  gen_regs* regs = &vcpu->guest_gen_regs;
+  unsigned int eax, ebx, ecx, edx;
+
+  cpuid_count((uint32_t)regs->rax, (uint32_t)regs->rcx, &eax, &ebx, &ecx, &edx);
+  if ((uint32_t)regs->rax == 1) {
+    ecx &= ~(1u << 5);  // VMX
+    ecx |= 1u << 31;    // hypervisor present
+  }
+  regs->rax = eax;
+  regs->rbx = ebx;
+  regs->rcx = ecx;
+  regs->rdx = edx;
+  return skip_guest_instruction();
+}
+
+// An exit userspace emulates is completed by the next PROTO_RUN, with what
+// the exit read kept here rather than trusted from the run page
+static void pend_user_exit(struct vcpu* vcpu, uint32_t exit_reason, uint64_t qual) {
+  vcpu->pending_exit = exit_reason;
+  vcpu->pending_qual = qual;
+  vcpu->pending_len = vmreadz(VMX_VMEXIT_INSTRUCTION_LENGTH);
+  vcpu->resume_pending = true;
+}
+
+// Finish the IN or RDMSR userspace emulated with the value it left in the
+// run page, then step over the instruction, also for OUT and WRMSR
+static void complete_user_exit(struct vcpu* vcpu) {
+  struct proto_run* run = vcpu->run;
+  gen_regs* regs = &vcpu->guest_gen_regs;
+  uint64_t data;
+
+  switch (vcpu->pending_exit) {
+    // CH 27.2.1, Vol 3, Table 27-5: a 4-byte IN zero-extends into RAX
+    case vmexit_io_instruction:
+      if (!((vcpu->pending_qual >> 3) & 1))
+        break;
+      data = READ_ONCE(run->io.data);
+      switch ((vcpu->pending_qual & 7) + 1) {
+        case 1:
+          regs->rax = (regs->rax & ~0xffULL) | (uint8_t)data;
+          break;
+        case 2:
+          regs->rax = (regs->rax & ~0xffffULL) | (uint16_t)data;
+          break;
+        default:
+          regs->rax = (uint32_t)data;
+          break;
+      }
+      break;
+    case vmexit_rdmsr:
+      data = READ_ONCE(run->msr.data);
+      regs->rax = (uint32_t)data;
+      regs->rdx = data >> 32;
+      break;
+  }
+  vmwrite(GUEST_RIP, vmreadz(GUEST_RIP) + vcpu->pending_len);
+}
+
+// Fill the shared run page for an exit that is returned to userspace
+void record_exit(struct vcpu* vcpu, uint32_t exit_reason) {
+  struct proto_run* run = vcpu->run;
+  gen_regs* regs = &vcpu->guest_gen_regs;
+  uint64_t qual = vmreadz(EXIT_QUALIFICATION);
+
+  run->hw_exit_reason = exit_reason;
+  run->exit_qualification = qual;
+  run->regs = (struct proto_regs){
+    .rax = regs->rax, .rbx = regs->rbx, .rcx = regs->rcx, .rdx = regs->rdx,
+    .rsi = regs->rsi, .rdi = regs->rdi, .rbp = regs->rbp,
+    .r8 = regs->r8, .r9 = regs->r9, .r10 = regs->r10, .r11 = regs->r11,
+    .r12 = regs->r12, .r13 = regs->r13, .r14 = regs->r14, .r15 = regs->r15,
+    .rip = vmreadz(GUEST_RIP), .rsp = vmreadz(GUEST_RSP),
+    .rflags = vmreadz(GUEST_RFLAGS),
+  };
+  switch (exit_reason) {
+    case vmexit_hlt:
+      run->exit_reason = PROTO_EXIT_HLT;
+      break;
+    // CH 27.2.1, Vol 3, Table 27-5
+    case vmexit_io_instruction:
+      run->exit_reason = PROTO_EXIT_IO;
+      run->io.size = (qual & 7) + 1;
+      run->io.in = (qual >> 3) & 1;
+      run->io.string = (qual >> 4) & 1;
+      run->io.port = qual >> 16;
+      if (!run->io.in)
+        run->io.data = regs->rax & GENMASK_ULL(run->io.size * 8 - 1, 0);
+      // INS and OUTS also move RDI/RSI and RCX, which userspace cannot
+      if (!run->io.string)
+        pend_user_exit(vcpu, exit_reason, qual);
+      break;
+    case vmexit_ept_violation:
+      run->mmio.gpa = vmreadz(GUEST_PHYSICAL_ADDRESS);
+      run->mmio.write = (qual >> 1) & 1;
+      run->exit_reason = run->mmio.gpa < vcpu->vm_memory_size ?
+                         PROTO_EXIT_INTERNAL : PROTO_EXIT_MMIO;
+      break;
+    case vmexit_triple_fault:
+      run->exit_reason = PROTO_EXIT_SHUTDOWN;
+      break;
+    // the guest stopped between two instructions and can go on from there
+    case vmexit_vmx_preemption_timer_expired:
+      run->exit_reason = PROTO_EXIT_PREEMPTED;
+      vcpu->resume_pending = true;
+      break;
+    case vmexit_rdmsr:
+    case vmexit_wrmsr:
+      run->exit_reason = PROTO_EXIT_MSR;
+      run->msr.index = regs->rcx;
+      run->msr.write = exit_reason == vmexit_wrmsr;
+      run->msr.data = (regs->rdx << 32) | (uint32_t)regs->rax;
+      pend_user_exit(vcpu, exit_reason, qual);
+      break;
+    default:
+      run->exit_reason = PROTO_EXIT_UNKNOWN;
+      break;
+  }
+}
+
+// CH 25.5.1, Vol 3
+// Load the preemption timer with what is left of the run's time slice.
+// The timer restarts from its VMCS value on every entry, so it is rearmed
+// before each VMRESUME. Returns false once the slice is used up.
+bool arm_preemption_timer(struct vcpu* vcpu) {
+  uint64_t now = rdtsc();
+  uint64_t ticks;
+
+  if (!preemption_timer_supported)
+    return true;
+  if (now >= vcpu->slice_deadline)
+    return false;
+  ticks = (vcpu->slice_deadline - now) >> preemption_timer_rate;
+  vmwrite(VMX_PREEMPTION_TIMER_VALUE, min_t(uint64_t, ticks, U32_MAX));
+  return true;
+}
+
+// A new guest's x87 and SSE control words start at their reset values,
+// every other component in its init state (XSTATE_BV 0)
+bool alloc_guest_fpu(struct vcpu* vcpu) {
+  vcpu->guest_fpu = alloc_pages_exact(guest_fpu_size, GFP_KERNEL | __GFP_ZERO);
+  if (!vcpu->guest_fpu)
+    return false;
+  *(uint16_t*)vcpu->guest_fpu = FPU_DEFAULT_FCW;
+  *(uint32_t*)(vcpu->guest_fpu + FXSAVE_MXCSR_OFFSET) = MXCSR_DEFAULT;
+  return true;
+}
+
+// The guest's first x87/SSE/AVX instruction in a run raises #NM because of
+// CR0.TS, and the exit goes back to run_vm(), which calls this before every
+// entry for the rest of the run. kernel_fpu_begin() moves the caller's own
+// FPU state out of the registers (it is reloaded on return to userspace),
+// then the guest's is loaded and the instruction retried without TS or the
+// #NM exit. XRSTOR puts components the guest never used in their init
+// state cheaply. Runs that do not touch the FPU pay nothing.
+// kernel_fpu_begin() takes fpregs_lock() only with interrupts on, so it is
+// called with them on, like kernel_fpu_end() in guest_fpu_put().
+static void guest_fpu_load(struct vcpu* vcpu) {
+  kernel_fpu_begin();
+  if (guest_xfeatures)
+    xrstor_area(vcpu->guest_fpu, guest_xfeatures);
+  else
+    asm volatile("fxrstor64 (%0)" : : "r"(vcpu->guest_fpu) : "memory");
+  vmwrite(GUEST_CR0, vmreadz(GUEST_CR0) & ~CR0_TS);
+  vmwrite(EXCEPTION_BITMAP, 0);
+  vcpu->fpu_loaded = true;
+}
+
+// At the end of a run that loaded the guest FPU state: save it and arm
+// the #NM exit again. XSAVEOPT skips the components that are in their init
+// state or unmodified since the XRSTOR. Needs the VMCS current.
+void guest_fpu_put(struct vcpu* vcpu) {
+  if (!vcpu->fpu_loaded)
+    return;
+  if (guest_xfeatures)
+    xsave_area(vcpu->guest_fpu, guest_xfeatures, boot_cpu_has(X86_FEATURE_XSAVEOPT));
+  else
+    asm volatile("fxsave64 (%0)" : : "r"(vcpu->guest_fpu) : "memory");
+  kernel_fpu_end();
+  vmwrite(GUEST_CR0, vmreadz(GUEST_CR0) | CR0_TS);
+  vmwrite(EXCEPTION_BITMAP, 1 << NM_VECTOR);
+  vcpu->fpu_loaded = false;
+}
+
+// CH 27.2.2, Vol 3: only #NM is intercepted
+static bool handle_exception(struct vcpu* vcpu) {
+  uint32_t info = vmreadz(VM_EXIT_INTR_INFO);
+
+  if ((info & (INTR_INFO_TYPE_MASK | INTR_INFO_VECTOR_MASK)) !=
+      (INTR_TYPE_HARD_EXCEPTION | NM_VECTOR) || vcpu->fpu_loaded)
+    return false;
+  // loaded by the run loop, with interrupts on
+  vcpu->fpu_wanted = true;
+  vcpu->stats.fpu_loads++;
+  return true;
+}
+
+static void record_entry_failure(struct vcpu* vcpu) {
+  vcpu->run->exit_reason = PROTO_EXIT_FAIL_ENTRY;
+  vcpu->run->hw_exit_reason = vmreadz(VM_INSTRUCTION_ERROR);
+}
+
+// Called on every exit with the guest GPRs saved in vcpu->guest_gen_regs.
+// Exits it can handle return true to resume the guest directly, so the
+// whole run loop stays in the kernel; anything else is described in the
+// run page and ends PROTO_RUN.
+bool vmexit_dispatch(struct vcpu* vcpu) {
+  uint64_t start = rdtsc();
+  uint32_t exit_reason = vmExit_reason();
+  if (unlikely(verbose_exits)) {
+    printk(KERN_INFO "VMX: vmexit_dispatch called: 0x%x 0x%llx\n", exit_reason, vmreadz(GUEST_RIP));
+    info();
+  }
+
+  switch (exit_reason) {
+    case vmexit_nmi:
+      // CH 27.2.2, Vol 3: a host NMI (perf, watchdog) that arrived in the
+      // guest. NMIs stay blocked until the IRET of its handler, which runs
+      // here as if the NMI had hit the host, and the guest goes on.
+      if ((vmreadz(VM_EXIT_INTR_INFO) & INTR_INFO_TYPE_MASK) == INTR_TYPE_NMI_INTR) {
+        asm volatile("int $2");
+        break;
+      }
+      if (!handle_exception(vcpu))
+        goto exit_to_host;
+      goto reenter;
+    case vmexit_vmcall:
+      if (!handle_vmcall(vcpu))
+        goto exit_to_host;
+      if (vcpu->populate_end)
+        goto reenter;
+      break;
+    case vmexit_cpuid:
+      if (!handle_cpuid(vcpu))
+        goto exit_to_host;
+      break;
+    case vmexit_ept_violation:
+      // the faulting instruction is retried, so RIP is left alone
+      if (!handle_ept_violation(vcpu))
+        goto exit_to_host;
+      break;
+    // the write that found the log full is retried once it is drained
+    case vmexit_pml_full:
+      drain_pml_log(vcpu);
+      break;
+    // CH 25.2, Vol 3: the interrupt is still pending, and the run loop
+    // takes it as soon as it enables interrupts
+    case vmexit_ext_int:
+      goto reenter;
+    // the timer counts at most U32_MAX ticks, which can be less than the
+    // slice; it is rearmed below
+    case vmexit_vmx_preemption_timer_expired:
+      if (rdtsc() < vcpu->slice_deadline)
+        break;
+      goto exit_to_host;
+    default:
+      goto exit_to_host;
+  }
+  // a handler replaced a mapping, see unshare_image_region()
+  if (unlikely(vcpu->tlb_dirty))
+    vcpu_flush_tlb(vcpu);
+  vcpu->run->in_kernel_exits++;
+  account_exit(exit_reason, start);
+  if (unlikely(!arm_preemption_timer(vcpu))) {
+    // RIP is already past the handled instruction
+    record_exit(vcpu, vmexit_vmx_preemption_timer_expired);
+    return false;
+  }
+  return true;
+reenter:
+  vcpu->reenter = true;
+  vcpu->run->in_kernel_exits++;
+  account_exit(exit_reason, start);
+  return false;
+exit_to_host:
+  record_exit(vcpu, exit_reason);
+  account_exit(exit_reason, start);
+  return false;
+}
+
+// The old exit path, with legacy_exit_path: _vmlaunch() makes this
+// HOST_RIP's callee. The compiler may clobber guest GPRs before
+// save_regs(), except RDI, and the host GPRs are put back by hand before
+// returning into _vmlaunch().
+void vmexit_handler(void) {
+  struct vcpu* vcpu = this_cpu_read(current_vcpu);
+  // _vmlaunch() stored the guest's RDI already
+  uint64_t rdi = vcpu->guest_gen_regs.rdi;
+  save_regs(&vcpu->guest_gen_regs);
+  vcpu->guest_gen_regs.rdi = rdi;
+  if (vmexit_dispatch(vcpu)) {
+    vmresume(vcpu);
+    record_entry_failure(vcpu);
+  }
+  restore_regs(&vcpu->host_gen_regs);
+}
+
+bool initVmLaunchProcess(struct vcpu* vcpu) {
+  if (likely(!legacy_exit_path)) {
+    // guest_gen_regs is where proto_vcpu_run() keeps the guest GPRs
+    BUILD_BUG_ON(offsetof(struct vcpu, guest_gen_regs) != 0);
+    if (proto_vcpu_run(vcpu, vcpu->launched))
+      record_entry_failure(vcpu);
+    else
+      vcpu->launched = true;
+    return true;
+  }
+  // _vmlaunch() only launches, which needs the clear launch state
+  if (vcpu->launched) {
+    if (_vmclear(__pa(vcpu->vmcsRegion)) || _vmptrld(__pa(vcpu->vmcsRegion)))
+      return false;
+    vcpu->launched = false;
+  }
+  this_cpu_write(current_vcpu, vcpu);
+	_vmlaunch(&vcpu->host_gen_regs, (uint64_t)vmexit_handler, &vcpu->guest_gen_regs);
+  vcpu->launched = true;
+  if (unlikely(verbose_exits))
+	  printk(KERN_INFO "VM exit reason is %lu!\n", (unsigned long)vmExit_reason());
+	return true;
+}
+
+// Host state that belongs to the calling task has to be rewritten before
+// every entry, since runs may come from different processes. CR4 carries
+// per-task bits too (TSD, PCE), but rarely changes, so it is only written
+// when it did.
+void refresh_host_state(struct vcpu* vcpu) {
+  unsigned long cr4 = cr4_read_shadow();
+
+  vmwrite(HOST_CR3, get_cr3());
+  vmwrite(HOST_FS_BASE, __rdmsr1(MSR_FS_BASE));
+  if (unlikely(cr4 != vcpu->host_cr4)) {
+    vmwrite(HOST_CR4, cr4);
+    vcpu->host_cr4 = cr4;
+  }
+}
+
+// Host state that differs between CPUs, rewritten when a vCPU migrates
+void refresh_host_cpu_state(void) {
+  vmwrite(HOST_GS_BASE, __rdmsr1(MSR_GS_BASE));
+	vmwrite(HOST_TR_BASE, get_desc64_base((struct desc64 *)(get_gdt_base1() + get_tr1())));
+	vmwrite(HOST_GDTR_BASE, get_gdt_base1());
+	vmwrite(HOST_IA32_SYSENTER_ESP, __rdmsr1(MSR_IA32_SYSENTER_ESP));
+}
+
+void reset_guest_entry_state(struct vcpu* vcpu) {
+  vmwrite(GUEST_RSP, vcpu->entry_rsp);
+  vmwrite(GUEST_RIP, vcpu->entry_rip);
+  vmwrite(GUEST_RFLAGS, 2);
+}
+
+long create_vm(struct vcpu* vcpu, struct proto_vm_config* config) {
+  uint64_t mem_size = config->mem_size ? config->mem_size : PROTO_DEFAULT_MEM_SIZE;
+  long ret = -ENOMEM;
+  int cpu;
+
+  if (vcpu->vm_created)
+    return -EEXIST;
+  if (mem_size < GUEST_MIN_MEM_SIZE || mem_size > GUEST_MAX_MEM_SIZE ||
+      !IS_ALIGNED(mem_size, MYPAGE_SIZE) ||
+      (config->flags & ~(PROTO_VM_NO_VPID | PROTO_VM_DIRTY_LOG | PROTO_VM_USER_CONSOLE)) ||
+      config->time_slice_us > 60 * USEC_PER_SEC)
+    return -EINVAL;
+  if ((config->flags & PROTO_VM_DIRTY_LOG) && !pml_supported())
+    return -EOPNOTSUPP;
+  vcpu->vm_memory_size = mem_size;
+  // the VM's pages come from the node it is created on
+  vcpu->node = numa_node_id();
+
+	if (!vmcsOperations(vcpu)) {
+		printk(KERN_INFO "VMCS Allocation failed! EXITING");
+		return -ENOMEM;
+	}
+  // running out of VPIDs only costs performance
+  if (!(config->flags & PROTO_VM_NO_VPID) && vpid_supported()) {
+    int vpid = ida_alloc_range(&vpid_ida, 1, VMX_NR_VPIDS - 1, GFP_KERNEL);
+
+    vcpu->vpid = vpid > 0 ? vpid : 0;
+  }
+  vcpu->tlb_dirty = true;
+  // 0 for a run only a signal or an exit to userspace ends
+  vcpu->time_slice_tsc = (config->time_slice_us ? config->time_slice_us : time_slice_us) *
+                         (uint64_t)tsc_khz / 1000;
+  vcpu->resume_pending = false;
+  vcpu->pending_exit = 0;
+  vcpu->entry_rip = GUEST_ENTRY_RIP;
+  vcpu->entry_rsp = GUEST_ENTRY_RSP;
+  vcpu->user_console = config->flags & PROTO_VM_USER_CONSOLE;
+  vcpu->stats.console_gpa = ~0ULL;
+  // everything that may sleep happens before the VMCS is made current
+  if ((config->flags & PROTO_VM_DIRTY_LOG) && !alloc_dirty_log(vcpu))
+    goto fail;
+  if (!alloc_guest_fpu(vcpu))
+    goto fail;
+  if (!alloc_intercept_bitmaps(vcpu) || !init_ept(vcpu) ||
+      !populate_guest_region(vcpu, 0, GFP_KERNEL))
+    goto fail;
+  if (!setup_guest_page_tables(vcpu)) {
+    ret = -EINVAL;
+    goto fail;
+  }
+
+  cpu = get_cpu();
+	if (!this_cpu_read(vmx_enabled) || !vcpu_load(vcpu, cpu) ||
+      !initVmcsControlField(vcpu)) {
+    put_cpu();
+		printk(KERN_INFO "Initialization of VMCS Control field failed! EXITING");
+    ret = -EIO;
+    goto fail;
+	}
+  put_cpu();
+  vcpu->vm_created = true;
+  mutex_lock(&console_vcpus_lock);
+  list_add(&vcpu->console_node, &console_vcpus);
+  mutex_unlock(&console_vcpus_lock);
+  printk(KERN_INFO "VMX: created VM with 0x%llx bytes of guest memory\n",
+         (unsigned long long)vcpu->vm_memory_size);
+  return 0;
+
+fail:
+  vcpu_clear(vcpu);
+  deallocate_guest_memory(vcpu);
+  deallocate_vmcs_region(vcpu);
+  if (vcpu->vpid)
+    ida_free(&vpid_ida, vcpu->vpid);
+  vcpu->vpid = 0;
+  return ret;
+}
+
+// Copy [src, src+size) from the caller to guest RAM at gpa, backing the
+// chunks it lands in. The range must be inside guest RAM.
+static long copy_to_guest(struct vcpu* vcpu, uint64_t gpa, uint64_t src, uint64_t size) {
+  uint64_t offset, len;
+
+  while (size) {
+    if (!populate_guest_region(vcpu, gpa, GFP_KERNEL))
+      return -ENOMEM;
+    offset = gpa % GUEST_CHUNK_SIZE;
+    len = min_t(uint64_t, size, GUEST_CHUNK_SIZE - offset);
+    if (copy_from_user(vcpu->vm_chunks[gpa / GUEST_CHUNK_SIZE] + offset,
+                       (void __user *)src, len))
+      return -EFAULT;
+    gpa += len;
+    src += len;
+    size -= len;
+  }
+  return 0;
+}
+
+// Zero guest RAM at [gpa, gpa+size). Chunks that are not backed yet are
+// zeroed when they are, so they are left alone, unless they would be
+// backed with a copy of the shared image.
+static long clear_guest(struct vcpu* vcpu, uint64_t gpa, uint64_t size) {
+  uint64_t offset, len;
+  uint8_t* chunk;
+
+  while (size) {
+    offset = gpa % GUEST_CHUNK_SIZE;
+    len = min_t(uint64_t, size, GUEST_CHUNK_SIZE - offset);
+    if (image_chunk(vcpu, gpa) && !populate_guest_region(vcpu, gpa, GFP_KERNEL))
+      return -ENOMEM;
+    chunk = READ_ONCE(vcpu->vm_chunks[gpa / GUEST_CHUNK_SIZE]);
+    if (chunk)
+      memset(chunk + offset, 0, len);
+    gpa += len;
+    size -= len;
+  }
+  return 0;
+}
+
+long load_guest_memory(struct vcpu* vcpu, struct proto_mem_load* load) {
+  long ret;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  if (load->guest_addr > vcpu->vm_memory_size ||
+      load->size > vcpu->vm_memory_size - load->guest_addr)
+    return -EINVAL;
+  ret = copy_to_guest(vcpu, load->guest_addr, load->user_addr, load->size);
+  // the image may contain guest page tables
+  vcpu->tlb_dirty = true;
+  return ret;
+}
+
+// Image segments go anywhere in guest RAM except over the page tables
+// built by setup_guest_page_tables()
+static bool image_range_ok(struct vcpu* vcpu, uint64_t gpa, uint64_t size) {
+  if (gpa > vcpu->vm_memory_size || size > vcpu->vm_memory_size - gpa)
+    return false;
+  return !size || gpa >= GUEST_PAGE_TABLES_END || gpa + size <= GUEST_PAGE_TABLES;
+}
+
+// Check every PT_LOAD segment before copying any, then copy each one from
+// the caller's image straight to its p_paddr, which the guest's identity
+// map makes its virtual address too, and zero the rest of p_memsz
+static long load_elf_image(struct vcpu* vcpu, struct proto_image_load* image) {
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr* phdrs;
+  long ret = -ENOEXEC;
+
+  if (image->size < sizeof(ehdr))
+    return -ENOEXEC;
+  if (copy_from_user(&ehdr, (void __user *)image->user_addr, sizeof(ehdr)))
+    return -EFAULT;
+  if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr.e_machine != EM_X86_64 || ehdr.e_type != ET_EXEC ||
+      ehdr.e_phentsize != sizeof(Elf64_Phdr) || !ehdr.e_phnum ||
+      ehdr.e_phnum > PROTO_IMAGE_MAX_PHDRS || ehdr.e_phoff > image->size ||
+      ehdr.e_phnum * sizeof(Elf64_Phdr) > image->size - ehdr.e_phoff)
+    return -ENOEXEC;
+
+  phdrs = kmalloc_array(ehdr.e_phnum, sizeof(*phdrs), GFP_KERNEL);
+  if (!phdrs)
+    return -ENOMEM;
+  if (copy_from_user(phdrs, (void __user *)(image->user_addr + ehdr.e_phoff),
+                     ehdr.e_phnum * sizeof(*phdrs))) {
+    ret = -EFAULT;
+    goto out;
+  }
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    Elf64_Phdr* phdr = &phdrs[i];
+
+    if (phdr->p_type != PT_LOAD)
+      continue;
+    if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset > image->size ||
+        phdr->p_filesz > image->size - phdr->p_offset ||
+        !image_range_ok(vcpu, phdr->p_paddr, phdr->p_memsz))
+      goto out;
+  }
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    Elf64_Phdr* phdr = &phdrs[i];
+
+    if (phdr->p_type != PT_LOAD)
+      continue;
+    ret = copy_to_guest(vcpu, phdr->p_paddr, image->user_addr + phdr->p_offset,
+                        phdr->p_filesz);
+    if (ret)
+      goto out;
+    ret = clear_guest(vcpu, phdr->p_paddr + phdr->p_filesz, phdr->p_memsz - phdr->p_filesz);
+    if (ret)
+      goto out;
+  }
+  image->entry = ehdr.e_entry;
+  ret = 0;
+out:
+  kfree(phdrs);
+  return ret;
+}
+
+// Load an image and make the next PROTO_RUN start at its entry point, even
+// if the last run was preempted. Only the image's own bytes are copied.
+long load_guest_image(struct vcpu* vcpu, struct proto_image_load* image) {
+  uint64_t stack = image->stack ? image->stack : GUEST_ENTRY_RSP;
+  long ret;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  if (stack > vcpu->vm_memory_size)
+    return -EINVAL;
+
+  switch (image->format) {
+    case PROTO_IMAGE_FLAT:
+      if (!image_range_ok(vcpu, image->load_addr, image->size))
+        return -EINVAL;
+      if (!image->entry)
+        image->entry = image->load_addr;
+      ret = copy_to_guest(vcpu, image->load_addr, image->user_addr, image->size);
+      break;
+    case PROTO_IMAGE_ELF:
+      ret = load_elf_image(vcpu, image);
+      break;
+    default:
+      return -EINVAL;
+  }
+  vcpu->tlb_dirty = true;
+  if (ret)
+    return ret;
+  if (image->entry >= vcpu->vm_memory_size)
+    return -ENOEXEC;
+
+  vcpu->entry_rip = image->entry;
+  vcpu->entry_rsp = stack;
+  image->stack = stack;
+  vcpu->resume_pending = false;
+  vcpu->pending_exit = 0;
+  return 0;
+}
+
+static void free_shared_image(struct kref* ref) {
+  struct shared_image* img = container_of(ref, struct shared_image, ref);
+
+  if (img->pml4)
+    ept_free_tables(&ept_ops, img->pml4);
+  for (uint64_t i = 0; i < img->nr_chunks; i++)
+    free_guest_chunk(img->chunks[i]);
+  kvfree(img);
+}
+
+static int shared_image_release(struct inode* inode, struct file* file) {
+  struct shared_image* img = file->private_data;
+
+  kref_put(&img->ref, free_shared_image);
+  return 0;
+}
+
+static const struct file_operations shared_image_fops = {
+  .owner = THIS_MODULE,
+  .release = shared_image_release,
+};
+
+// CH 28.2.2, Vol 3
+// Copy the image into chunks once and map it at GPA 0 of an EPT of its
+// own, read-only with 2MB leaves. Every VM mapping it links the image's
+// page directories into its EPT, so a fleet booted from one image shares
+// its memory and all of its EPT tables below the PDPT, and mapping it
+// costs one entry per 1GB.
+long create_shared_image(struct proto_shared_image* req) {
+  uint64_t size = round_up(req->size, GUEST_CHUNK_SIZE);
+  struct shared_image* img;
+  uint64_t offset, len;
+  long ret = -ENOMEM;
+  int fd;
+
+  if (!(vmx_ept_vpid_caps & VMX_EPT_2MB_PAGE_BIT))
+    return -EOPNOTSUPP;
+  if (!req->size || size > SHARED_IMAGE_MAX_SIZE)
+    return -EINVAL;
+
+  img = kvzalloc(struct_size(img, chunks, size / GUEST_CHUNK_SIZE), GFP_KERNEL);
+  if (!img)
+    return -ENOMEM;
+  kref_init(&img->ref);
+  img->size = size;
+  img->pml4 = pool_alloc(POOL_PAGE, numa_node_id(), GFP_KERNEL | __GFP_ZERO);
+  if (!img->pml4)
+    goto fail;
+  for (offset = 0; offset < size; offset += GUEST_CHUNK_SIZE) {
+    uint8_t* chunk = alloc_guest_chunk(numa_node_id(), GFP_KERNEL);
+
+    if (!chunk)
+      goto fail;
+    img->chunks[img->nr_chunks++] = chunk;
+    len = min_t(uint64_t, req->size - offset, GUEST_CHUNK_SIZE);
+    if (offset < req->size &&
+        copy_from_user(chunk, (void __user *)(req->user_addr + offset), len)) {
+      ret = -EFAULT;
+      goto fail;
+    }
+    if (!ept_map_range(&ept_ops, img->pml4, offset, virt_to_phys(chunk),
+                       GUEST_CHUNK_SIZE, VMX_EPT_2MB_PAGE_BIT, false))
+      goto fail;
+  }
+  for (uint64_t i = 0; i < DIV_ROUND_UP(size, GUEST_PAGE_SIZE_1GB); i++)
+    img->pds[i] = ept_pd(&ept_ops, img->pml4, i * GUEST_PAGE_SIZE_1GB);
+
+  fd = anon_inode_getfd("proto-image", &shared_image_fops, img, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ret = fd;
+    goto fail;
+  }
+  req->fd = fd;
+  return 0;
+
+fail:
+  kref_put(&img->ref, free_shared_image);
+  return ret;
+}
+
+// Called with mem_lock held. The windows go back to unmapped, so the
+// regions read from the image are copied on their next access.
+static void unlink_shared_windows(struct vcpu* vcpu) {
+  for (uint64_t window = 0; window < 64; window++)
+    if (vcpu->shared_windows & BIT_ULL(window))
+      ept_unlink_pd(&ept_ops, vcpu->pml4,
+                    vcpu->image_gpa + window * GUEST_PAGE_SIZE_1GB);
+  vcpu->shared_windows = 0;
+  vcpu->stats.shared_bytes = 0;
+}
+
+// Link the image's page directories into the EPT, one PDPT entry per 1GB.
+// Only 1GB windows nothing else was mapped in can be linked, which is why
+// the image goes above the first 1GB, where the guest page tables are.
+long map_shared_image(struct vcpu* vcpu, struct proto_image_map* req) {
+  uint64_t gpa = req->guest_addr;
+  struct shared_image* img;
+  uint64_t windows, end;
+  struct file* file;
+  long ret = 0;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  file = fget(req->fd);
+  if (!file)
+    return -EBADF;
+  if (file->f_op != &shared_image_fops) {
+    fput(file);
+    return -EINVAL;
+  }
+  img = file->private_data;
+  windows = DIV_ROUND_UP(img->size, GUEST_PAGE_SIZE_1GB);
+  if (!IS_ALIGNED(gpa, GUEST_PAGE_SIZE_1GB) || gpa < GUEST_PAGE_SIZE_1GB ||
+      gpa >= vcpu->vm_memory_size || img->size > vcpu->vm_memory_size - gpa) {
+    ret = -EINVAL;
+    goto out;
+  }
+  end = min_t(uint64_t, gpa + windows * GUEST_PAGE_SIZE_1GB, vcpu->vm_memory_size);
+
+  spin_lock(&vcpu->mem_lock);
+  if (vcpu->image) {
+    ret = -EBUSY;
+    goto unlock;
+  }
+  for (uint64_t i = gpa / GUEST_CHUNK_SIZE; i < DIV_ROUND_UP(end, GUEST_CHUNK_SIZE); i++) {
+    if (vcpu->vm_chunks[i]) {
+      ret = -EBUSY;
+      goto unlock;
+    }
+  }
+  for (uint64_t window = 0; window < windows; window++) {
+    if (!ept_link_pd(&ept_ops, vcpu->pml4, gpa + window * GUEST_PAGE_SIZE_1GB,
+                     img->pds[window])) {
+      // a window with a directory of its own already is in use
+      ret = ept_pd(&ept_ops, vcpu->pml4, gpa + window * GUEST_PAGE_SIZE_1GB) ?
+            -EBUSY : -ENOMEM;
+      while (window--)
+        ept_unlink_pd(&ept_ops, vcpu->pml4, gpa + window * GUEST_PAGE_SIZE_1GB);
+      goto unlock;
+    }
+  }
+  kref_get(&img->ref);
+  vcpu->image_gpa = gpa;
+  vcpu->shared_windows = windows == 64 ? ~0ULL : BIT_ULL(windows) - 1;
+  vcpu->stats.shared_bytes = img->size;
+  WRITE_ONCE(vcpu->image, img);
+unlock:
+  spin_unlock(&vcpu->mem_lock);
+out:
+  fput(file);
+  return ret;
+}
+
+// The VM is gone, and so are the mappings of its guest RAM
+void detach_shared_image(struct vcpu* vcpu) {
+  if (!vcpu->image)
+    return;
+  unlink_shared_windows(vcpu);
+  kref_put(&vcpu->image->ref, free_shared_image);
+  vcpu->image = NULL;
+}
+
+// Guest state a snapshot restores besides the GPRs, CH 24.4.1, Vol 3
+static const uint32_t snapshot_fields[] = {
+  GUEST_RIP, GUEST_RSP, GUEST_RFLAGS, GUEST_CR0, GUEST_CR3, GUEST_CR4, GUEST_DR7,
+  GUEST_ES_SELECTOR, GUEST_CS_SELECTOR, GUEST_SS_SELECTOR, GUEST_DS_SELECTOR,
+  GUEST_FS_SELECTOR, GUEST_GS_SELECTOR, GUEST_LDTR_SELECTOR, GUEST_TR_SELECTOR,
+  GUEST_ES_BASE, GUEST_CS_BASE, GUEST_SS_BASE, GUEST_DS_BASE, GUEST_FS_BASE,
+  GUEST_GS_BASE, GUEST_LDTR_BASE, GUEST_TR_BASE, GUEST_GDTR_BASE, GUEST_IDTR_BASE,
+  GUEST_ES_LIMIT, GUEST_CS_LIMIT, GUEST_SS_LIMIT, GUEST_DS_LIMIT, GUEST_FS_LIMIT,
+  GUEST_GS_LIMIT, GUEST_LDTR_LIMIT, GUEST_TR_LIMIT, GUEST_GDTR_LIMIT, GUEST_IDTR_LIMIT,
+  GUEST_ES_AR_BYTES, GUEST_CS_AR_BYTES, GUEST_SS_AR_BYTES, GUEST_DS_AR_BYTES,
+  GUEST_FS_AR_BYTES, GUEST_GS_AR_BYTES, GUEST_LDTR_AR_BYTES, GUEST_TR_AR_BYTES,
+  GUEST_IA32_EFER, GUEST_IA32_PAT, GUEST_IA32_DEBUGCTL,
+  GUEST_SYSENTER_CS, GUEST_SYSENTER_ESP, GUEST_SYSENTER_EIP,
+  GUEST_INTERRUPTIBILITY_INFO, GUEST_ACTIVITY_STATE, GUEST_PENDING_DBG_EXCEPTIONS,
+};
+
+void free_snapshot(struct vcpu* vcpu, struct vm_snapshot* snap) {
+  if (!snap)
+    return;
+  if (snap->chunks) {
+    for (uint64_t i = 0; i < DIV_ROUND_UP(vcpu->vm_memory_size, GUEST_CHUNK_SIZE); i++)
+      free_guest_chunk(snap->chunks[i]);
+    kvfree(snap->chunks);
+  }
+  kvfree(snap->dirty_chunks);
+  bitmap_free(snap->dirty_bitmap);
+  kvfree(snap->guest_fpu);
+  kfree(snap);
+}
+
+// take_snapshot() unmaps guest RAM from the EPT; a chunk is mapped again,
+// write-protected, on the first guest access to it
+bool map_snapshot_chunk(struct vcpu* vcpu, uint64_t gpa) {
+  uint64_t base = round_down(gpa, GUEST_CHUNK_SIZE);
+  uint64_t hpa;
+  bool ret = true;
+
+  spin_lock(&vcpu->mem_lock);
+  if (!ept_translate(&ept_ops, vcpu->pml4, gpa, &hpa))
+    ret = map_guest_chunk(vcpu, base, vcpu->vm_chunks[base / GUEST_CHUNK_SIZE]);
+  spin_unlock(&vcpu->mem_lock);
+  return ret;
+}
+
+// Make the page at gpa writable and remember its chunk for the next reset,
+// which restores every writable page of it. Also called, with from_host,
+// for the pages the host writes on the guest's behalf, like the hypercall
+// ring; the guest may still have a read-only translation of those cached.
+bool mark_page_dirty(struct vcpu* vcpu, uint64_t gpa, bool from_host) {
+  struct vm_snapshot* snap = vcpu->snapshot;
+  uint64_t index = gpa / GUEST_CHUNK_SIZE;
+  EPT_PML1_ENTRY* pte;
+
+  if (!snap)
+    return true;
+  pte = ept_pte(&ept_ops, vcpu->pml4, gpa);
+  if (!pte) {
+    if (!map_snapshot_chunk(vcpu, gpa))
+      return false;
+    pte = ept_pte(&ept_ops, vcpu->pml4, gpa);
+    if (!pte)
+      return false;
+  }
+  // a guest write the EPT already allows only exits through such a stale
+  // translation, and is retried after the flush
+  if (pte->Fields.Write) {
+    if (!from_host)
+      vcpu->tlb_dirty = true;
+    return true;
+  }
+  pte->Fields.Write = 1;
+  if (from_host)
+    vcpu->tlb_dirty = true;
+  if (!__test_and_set_bit(index, snap->dirty_bitmap))
+    snap->dirty_chunks[snap->nr_dirty++] = index;
+  return true;
+}
+
+// Capture guest memory and the state the next PROTO_RUN would start from:
+// the entry state, or where the guest was preempted. Guest RAM is then
+// unmapped from the EPT so that it is remapped write-protected, see
+// map_guest_chunk(). Taking a new snapshot replaces the old one. Regions
+// the guest still reads from a shared image are copied on their first
+// access from then on, and reset puts the image's bytes back.
+long take_snapshot(struct vcpu* vcpu) {
+  uint64_t nr_chunks = DIV_ROUND_UP(vcpu->vm_memory_size, GUEST_CHUNK_SIZE);
+  struct vm_snapshot* snap;
+  uint8_t* chunk;
+  int cpu;
+
+  BUILD_BUG_ON(ARRAY_SIZE(snapshot_fields) != VM_SNAPSHOT_FIELDS);
+  if (!vcpu->vm_created)
+    return -ENOENT;
+
+  snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+  if (!snap)
+    return -ENOMEM;
+  snap->chunks = kvcalloc(nr_chunks, sizeof(*snap->chunks), GFP_KERNEL);
+  snap->dirty_chunks = kvcalloc(nr_chunks, sizeof(*snap->dirty_chunks), GFP_KERNEL);
+  snap->dirty_bitmap = bitmap_zalloc(nr_chunks, GFP_KERNEL);
+  if (!snap->chunks || !snap->dirty_chunks || !snap->dirty_bitmap)
+    goto fail;
+  // chunks backed later start out zeroed, which is what reset restores
+  for (uint64_t i = 0; i < nr_chunks; i++) {
+    chunk = READ_ONCE(vcpu->vm_chunks[i]);
+    if (!chunk)
+      continue;
+    snap->chunks[i] = alloc_guest_chunk(vcpu->node, GFP_KERNEL);
+    if (!snap->chunks[i])
+      goto fail;
+    memcpy(snap->chunks[i], chunk, GUEST_CHUNK_SIZE);
+  }
+  // the guest FPU state is only ever in guest_fpu between runs
+  snap->guest_fpu = kvmalloc(guest_fpu_size, GFP_KERNEL);
+  if (!snap->guest_fpu)
+    goto fail;
+  memcpy(snap->guest_fpu, vcpu->guest_fpu, guest_fpu_size);
+
+  cpu = get_cpu();
+  if (!this_cpu_read(vmx_enabled) || !vcpu_load(vcpu, cpu)) {
+    put_cpu();
+    goto fail;
+  }
+  if (!vcpu->resume_pending) {
+    reset_guest_entry_state(vcpu);
+    memset(&vcpu->guest_gen_regs, 0, sizeof(gen_regs));
+  }
+  for (int i = 0; i < ARRAY_SIZE(snapshot_fields); i++)
+    snap->fields[i] = vmreadz(snapshot_fields[i]);
+  put_cpu();
+  snap->regs = vcpu->guest_gen_regs;
+  snap->hc_ring = vcpu->hc_ring;
+  snap->hc_ring_gpa = vcpu->hc_ring_gpa;
+  snap->console_gpa = vcpu->stats.console_gpa;
+  vcpu->resume_pending = true;
+
+  // map_guest_chunk() checks for a snapshot under mem_lock
+  spin_lock(&vcpu->mem_lock);
+  swap(snap, vcpu->snapshot);
+  unlink_shared_windows(vcpu);
+  ept_unmap_all(&ept_ops, vcpu->pml4);
+  spin_unlock(&vcpu->mem_lock);
+  free_snapshot(vcpu, snap);
+  vcpu->tlb_dirty = true;
+  return 0;
+
+fail:
+  free_snapshot(vcpu, snap);
+  return -ENOMEM;
+}
+
+// Copy back every page written since the snapshot, write-protect it again
+// and restore the registers. The cost depends on the chunks and pages the
+// guest wrote, not on the size of guest RAM. The next PROTO_RUN continues
+// from the snapshot.
+long reset_to_snapshot(struct vcpu* vcpu) {
+  struct vm_snapshot* snap = vcpu->snapshot;
+  uint64_t restored = 0;
+  const uint8_t* src;
+  int cpu;
+
+  if (!vcpu->vm_created || !snap)
+    return -ENOENT;
+
+  for (uint64_t i = 0; i < snap->nr_dirty; i++) {
+    uint64_t index = snap->dirty_chunks[i];
+    uint64_t base = index * GUEST_CHUNK_SIZE;
+    uint64_t pages = min_t(uint64_t, GUEST_CHUNK_SIZE, vcpu->vm_memory_size - base) / MYPAGE_SIZE;
+    // a dirty chunk is mapped with 4K leaves, all in one page table
+    EPT_PML1_ENTRY* pt = ept_pte(&ept_ops, vcpu->pml4, base);
+
+    __clear_bit(index, snap->dirty_bitmap);
+    if (!pt)
+      continue;
+    src = snap->chunks[index] ? snap->chunks[index] : image_chunk(vcpu, base);
+    for (uint64_t page = 0; page < pages; page++) {
+      uint8_t* dst = vcpu->vm_chunks[index] + page * MYPAGE_SIZE;
+
+      if (!pt[page].Fields.Write)
+        continue;
+      if (src)
+        memcpy(dst, src + page * MYPAGE_SIZE, MYPAGE_SIZE);
+      else
+        memset(dst, 0, MYPAGE_SIZE);
+      pt[page].Fields.Write = 0;
+      restored++;
+    }
+  }
+  snap->nr_dirty = 0;
+  vcpu->stats.reset_pages += restored;
+  // revoking write access needs the stale translations gone
+  vcpu->tlb_dirty = true;
+
+  cpu = get_cpu();
+  if (!this_cpu_read(vmx_enabled) || !vcpu_load(vcpu, cpu)) {
+    put_cpu();
+    return -EIO;
+  }
+  for (int i = 0; i < ARRAY_SIZE(snapshot_fields); i++)
+    vmwrite(snapshot_fields[i], snap->fields[i]);
+  put_cpu();
+  vcpu->guest_gen_regs = snap->regs;
+  vcpu->hc_ring = snap->hc_ring;
+  vcpu->hc_ring_gpa = snap->hc_ring_gpa;
+  // the ring's head went back with guest RAM
+  if (snap->console_gpa == ~0ULL || !console_attach(vcpu, snap->console_gpa, GFP_KERNEL)) {
+    spin_lock(&vcpu->console_lock);
+    vcpu->console = NULL;
+    vcpu->stats.console_gpa = ~0ULL;
+    spin_unlock(&vcpu->console_lock);
+  }
+  memcpy(vcpu->guest_fpu, snap->guest_fpu, guest_fpu_size);
+  // an instruction emulated after the snapshot is executed again
+  vcpu->resume_pending = true;
+  vcpu->pending_exit = 0;
+  return 0;
+}
+
+// PML logs guest writes to a page the CPU addresses physically
+bool alloc_dirty_log(struct vcpu* vcpu) {
+  vcpu->pml_log = (uint64_t*)get_zeroed_page(GFP_KERNEL);
+  vcpu->dirty_log = kvcalloc(BITS_TO_LONGS(vcpu->vm_memory_size / MYPAGE_SIZE),
+                             sizeof(unsigned long), GFP_KERNEL);
+  return vcpu->pml_log && vcpu->dirty_log;
+}
+
+// CH 28.3.6, Vol 3
+// The CPU stores the GPA of each write that sets an EPT dirty flag at
+// GUEST_PML_INDEX and decrements it; the index wraps past 0 once the log
+// is full. Move the logged pages to dirty_log and start over. Should a
+// large EPT page show up, only its first write is logged, so all of it
+// counts as dirty. Needs the VMCS current.
+void drain_pml_log(struct vcpu* vcpu) {
+  uint16_t index = vmreadz(GUEST_PML_INDEX);
+  uint64_t pages = vcpu->vm_memory_size / MYPAGE_SIZE;
+  uint64_t gpa, hpa, size, first;
+
+  if (!vcpu->pml_log)
+    return;
+  spin_lock(&vcpu->mem_lock);
+  for (int i = index >= PML_ENTITY_NUM ? 0 : index + 1; i < PML_ENTITY_NUM; i++) {
+    gpa = vcpu->pml_log[i] & PAGE_MASK;
+    if (gpa >= vcpu->vm_memory_size)
+      continue;
+    size = ept_translate(&ept_ops, vcpu->pml4, gpa, &hpa);
+    if (size <= MYPAGE_SIZE) {
+      __set_bit(gpa / MYPAGE_SIZE, vcpu->dirty_log);
+      continue;
+    }
+    first = round_down(gpa, size) / MYPAGE_SIZE;
+    bitmap_set(vcpu->dirty_log, first, min_t(uint64_t, size / MYPAGE_SIZE, pages - first));
+  }
+  spin_unlock(&vcpu->mem_lock);
+  vmwrite(GUEST_PML_INDEX, PML_ENTITY_NUM - 1);
+  vcpu->stats.pml_flushes++;
+}
+
+// Clear the EPT dirty flags of the pages reported, so that their next
+// write is logged again, and drop the translations that cache them
+long get_dirty_log(struct vcpu* vcpu, struct proto_dirty_log* log) {
+  uint64_t pages = vcpu->vm_memory_size / MYPAGE_SIZE;
+  uint64_t bytes = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+  uint64_t page, size;
+  int cpu;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  if (!vcpu->pml_log)
+    return -EINVAL;
+  if (log->bitmap_size < bytes)
+    return -EINVAL;
+
+  cpu = get_cpu();
+  if (!this_cpu_read(vmx_enabled) || !vcpu_load(vcpu, cpu)) {
+    put_cpu();
+    return -EIO;
+  }
+  drain_pml_log(vcpu);
+  put_cpu();
+
+  spin_lock(&vcpu->mem_lock);
+  for (page = find_first_bit(vcpu->dirty_log, pages); page < pages;
+       page = find_next_bit(vcpu->dirty_log, pages, page + 1)) {
+    size = ept_clear_dirty(&ept_ops, vcpu->pml4, page * MYPAGE_SIZE);
+    // the rest of a large page is in the log already
+    if (size > MYPAGE_SIZE)
+      page = round_up(page + 1, size / MYPAGE_SIZE) - 1;
+  }
+  spin_unlock(&vcpu->mem_lock);
+  vcpu->tlb_dirty = true;
+
+  log->dirty_pages = bitmap_weight(vcpu->dirty_log, pages);
+  if (copy_to_user((void __user *)log->bitmap, vcpu->dirty_log, bytes))
+    return -EFAULT;
+  bitmap_zero(vcpu->dirty_log, pages);
+  return 0;
+}
+
+// The EPT is only walked below entries the guest went through since the
+// last clear, so a scan costs in proportion to what the guest touched, not
+// to the size of guest RAM.
+long get_working_set(struct vcpu* vcpu, struct proto_working_set* ws) {
+  uint64_t pages = vcpu->vm_memory_size / MYPAGE_SIZE;
+  uint64_t bytes = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+  struct ept_ad_scan scan = {
+    .pages = pages,
+    .clear = ws->flags & PROTO_WS_CLEAR,
+  };
+  long ret = 0;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  if (!(vmx_ept_vpid_caps & VMX_EPT_AD_BIT))
+    return -EOPNOTSUPP;
+  if ((ws->flags & ~PROTO_WS_CLEAR) || ws->reserved ||
+      ((ws->accessed || ws->dirty) && ws->bitmap_size < bytes))
+    return -EINVAL;
+
+  // one bit per 4K page is more than kmalloc() serves beyond 128GB
+  scan.accessed = kvcalloc(BITS_TO_LONGS(pages), sizeof(unsigned long), GFP_KERNEL);
+  scan.dirty = kvcalloc(BITS_TO_LONGS(pages), sizeof(unsigned long), GFP_KERNEL);
+  if (!scan.accessed || !scan.dirty) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  spin_lock(&vcpu->mem_lock);
+  scan.shared_base = vcpu->image_gpa;
+  scan.shared_windows = vcpu->shared_windows;
+  ept_scan_ad(&ept_ops, vcpu->pml4, &scan);
+  spin_unlock(&vcpu->mem_lock);
+  // cached translations would keep the CPU from setting the flags again
+  if (scan.clear)
+    vcpu->tlb_dirty = true;
+
+  ws->accessed_pages = bitmap_weight((unsigned long*)scan.accessed, pages);
+  ws->dirty_pages = bitmap_weight((unsigned long*)scan.dirty, pages);
+  ws->tables_scanned = scan.tables;
+  ws->tables_skipped = scan.tables_skipped;
+  if ((ws->accessed && copy_to_user((void __user *)ws->accessed, scan.accessed, bytes)) ||
+      (ws->dirty && copy_to_user((void __user *)ws->dirty, scan.dirty, bytes)))
+    ret = -EFAULT;
+out:
+  kvfree(scan.accessed);
+  kvfree(scan.dirty);
+  return ret;
+}
+
+// PROTO_HC_POPULATE, between two entries of the run loop: with GFP_KERNEL
+// and a chance to reschedule after every region. A region that cannot be
+// backed now is left to its first touch.
+static void populate_deferred(struct vcpu* vcpu) {
+  for (; vcpu->populate_gpa < vcpu->populate_end;
+       vcpu->populate_gpa += GUEST_CHUNK_SIZE) {
+    if (fatal_signal_pending(current) ||
+        !populate_guest_region(vcpu, vcpu->populate_gpa, GFP_KERNEL))
+      break;
+    cond_resched();
+  }
+  vcpu->populate_end = 0;
+}
+
+// The guest runs with interrupts enabled as far as the host can tell: they
+// are off only from the last checks before an entry until its exit, and a
+// host interrupt in between ends the entry (external-interrupt exiting).
+// Between entries the loop takes the interrupt, gives up the CPU when the
+// scheduler wants it and stops early for a signal, so a guest running for
+// seconds costs the host's other tasks no more latency than a user thread.
+// The task may move to another CPU between entries; see vcpu_load().
+long run_vm(struct vcpu* vcpu) {
+  bool entered = false, more;
+  int cpu;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+
+  // keep one chunk in reserve so a demand fault rarely needs GFP_ATOMIC
+  if (!READ_ONCE(vcpu->spare_chunk)) {
+    uint8_t* spare = alloc_guest_chunk(vcpu->node, GFP_KERNEL);
+
+    spin_lock(&vcpu->mem_lock);
+    if (!vcpu->spare_chunk) {
+      vcpu->spare_chunk = spare;
+      spare = NULL;
+    }
+    spin_unlock(&vcpu->mem_lock);
+    free_guest_chunk(spare);
+  }
+
+  vcpu->slice_deadline = vcpu->time_slice_tsc ? rdtsc() + vcpu->time_slice_tsc : U64_MAX;
+  do {
+    cpu = get_cpu();
+    if (!this_cpu_read(vmx_enabled) || !vcpu_load(vcpu, cpu)) {
+      put_cpu();
+      return -EIO;
+    }
+    refresh_host_state(vcpu);
+    // the guest-state area and the registers saved at the last exit are
+    // kept, so a preempted guest picks up where it stopped, and one that
+    // exited to userspace after its emulated instruction
+    if (!entered) {
+      if (!vcpu->resume_pending) {
+        reset_guest_entry_state(vcpu);
+        memset(&vcpu->guest_gen_regs, 0, sizeof(gen_regs));
+      } else if (vcpu->pending_exit) {
+        complete_user_exit(vcpu);
+      }
+      vcpu->pending_exit = 0;
+      vcpu->fpu_wanted = false;
+      memset(vcpu->run, 0, sizeof(*vcpu->run));
+    }
+    vcpu->resume_pending = false;
+    // page tables written through an mmap() of guest RAM cannot be tracked
+    if (vcpu->tlb_dirty || (!entered && READ_ONCE(vcpu->mmap_count)))
+      vcpu_flush_tlb(vcpu);
+    entered = true;
+    if (vcpu->fpu_wanted)
+      guest_fpu_load(vcpu);
+
+    local_irq_disable();
+    // a wakeup or signal sent after these checks comes with an IPI, which
+    // ends the entry right away
+    vcpu->reenter = false;
+    if (signal_pending(current) || !arm_preemption_timer(vcpu)) {
+      // the guest is between two instructions, as after a timer exit
+      record_exit(vcpu, vmexit_vmx_preemption_timer_expired);
+    } else if (need_resched()) {
+      vcpu->reenter = true;
+    } else if (!initVmLaunchProcess(vcpu)) {
+      printk(KERN_INFO "VMLAUNCH failed! EXITING");
+      local_irq_enable();
+      guest_fpu_put(vcpu);
+      put_cpu();
+      return -EIO;
+    }
+    local_irq_enable();
+    // with interrupts on, like kernel_fpu_begin(); see guest_fpu_load()
+    guest_fpu_put(vcpu);
+    put_cpu();
+    if (vcpu->populate_end)
+      populate_deferred(vcpu);
+    if (vcpu->reenter)
+      cond_resched();
+  } while (vcpu->reenter);
+
+  // at most a ring's worth of lines, rescheduling between drains
+  for (uint32_t lines = 0; vcpu->console && lines < vcpu->console_size;
+       lines += CONSOLE_DRAIN_LINES) {
+    spin_lock(&vcpu->console_lock);
+    more = drain_console(vcpu, true);
+    spin_unlock(&vcpu->console_lock);
+    if (!more)
+      break;
+    cond_resched();
+  }
+  return 0;
+}
+
+long destroy_vm(struct vcpu* vcpu) {
+  spin_lock(&vcpu->mem_lock);
+  if (!vcpu->vm_created) {
+    spin_unlock(&vcpu->mem_lock);
+    return -ENOENT;
+  }
+  // userspace mappings reference the chunks directly
+  if (vcpu->mmap_count) {
+    spin_unlock(&vcpu->mem_lock);
+    return -EBUSY;
+  }
+  vcpu->vm_created = false;
+  spin_unlock(&vcpu->mem_lock);
+
+  // the console thread reads the ring in guest RAM
+  mutex_lock(&console_vcpus_lock);
+  list_del(&vcpu->console_node);
+  mutex_unlock(&console_vcpus_lock);
+  vcpu->console = NULL;
+  vcpu_clear(vcpu);
+  deallocate_vmcs_region(vcpu);
+  deallocate_guest_memory(vcpu);
+  vcpu->vm_memory_size = 0;
+  vcpu->hc_ring = NULL;
+  if (vcpu->vpid)
+    ida_free(&vpid_ida, vcpu->vpid);
+  vcpu->vpid = 0;
+  memset(&vcpu->stats, 0, sizeof(vcpu->stats));
+  return 0;
+}
+
+// CH 24.6.4, Vol 3
+// Start with every port and MSR access trapping
+bool alloc_intercept_bitmaps(struct vcpu* vcpu) {
+  vcpu->io_bitmap_a = kmalloc(MYPAGE_SIZE, GFP_KERNEL);
+  vcpu->io_bitmap_b = kmalloc(MYPAGE_SIZE, GFP_KERNEL);
+  vcpu->msr_bitmap = kmalloc(MYPAGE_SIZE, GFP_KERNEL);
+  if (!vcpu->io_bitmap_a || !vcpu->io_bitmap_b || !vcpu->msr_bitmap)
+    return false;
+  memset(vcpu->io_bitmap_a, 0xff, MYPAGE_SIZE);
+  memset(vcpu->io_bitmap_b, 0xff, MYPAGE_SIZE);
+  memset(vcpu->msr_bitmap, 0xff, MYPAGE_SIZE);
+  return true;
+}
+
+// MSRs a guest may read without an exit. No MSR is loaded or stored for
+// the guest beyond the VMCS guest-state area, so any other MSR would show
+// it the host's value, and no write passes through at all.
+static const uint32_t passthrough_msrs[] = {
+  // CH 27.3.1 and 28.3.1, Vol 3: switched on every entry and exit
+  MSR_IA32_SYSENTER_CS, MSR_IA32_SYSENTER_ESP, MSR_IA32_SYSENTER_EIP,
+  MSR_FS_BASE, MSR_GS_BASE,
+  // what RDTSC shows the guest anyway
+  MSR_IA32_TSC,
+};
+
+static bool msr_passthrough_allowed(uint64_t first, uint64_t last) {
+  for (uint64_t msr = first; msr < last; msr++) {
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(passthrough_msrs); i++)
+      if (passthrough_msrs[i] == msr)
+        break;
+    if (i == ARRAY_SIZE(passthrough_msrs))
+      return false;
+  }
+  return true;
+}
+
+// The CPU reads the bitmaps on each access, and runs are serialized with
+// this ioctl by vcpu->lock, so the change applies from the next run on
+long set_intercept(struct vcpu* vcpu, struct proto_intercept* req) {
+  uint64_t first = req->first;
+  uint64_t last = first + req->count;
+  uint8_t* bitmap;
+
+  if (!vcpu->vm_created)
+    return -ENOENT;
+
+  switch (req->kind) {
+    case PROTO_INTERCEPT_IO:
+      if (last > 0x10000)
+        return -EINVAL;
+      for (uint64_t port = first; port < last; port++) {
+        // bitmap A covers ports 0-0x7fff, B 0x8000-0xffff
+        bitmap = port < 0x8000 ? vcpu->io_bitmap_a : vcpu->io_bitmap_b;
+        if (req->trap)
+          __set_bit(port & 0x7fff, (unsigned long*)bitmap);
+        else
+          __clear_bit(port & 0x7fff, (unsigned long*)bitmap);
+      }
+      return 0;
+    case PROTO_INTERCEPT_MSR_READ:
+    case PROTO_INTERCEPT_MSR_WRITE:
+      if (!req->trap && (req->kind == PROTO_INTERCEPT_MSR_WRITE ||
+                         !msr_passthrough_allowed(first, last)))
+        return -EPERM;
+      // CH 24.6.9, Vol 3: read-low, read-high, write-low, write-high, 1KB each
+      bitmap = vcpu->msr_bitmap;
+      if (req->kind == PROTO_INTERCEPT_MSR_WRITE)
+        bitmap += 2048;
+      if (last <= MSR_BITMAP_LOW_BASE + MSR_BITMAP_RANGE) {
+        first -= MSR_BITMAP_LOW_BASE;
+      } else if (first >= MSR_BITMAP_HIGH_BASE &&
+                 last <= MSR_BITMAP_HIGH_BASE + MSR_BITMAP_RANGE) {
+        first -= MSR_BITMAP_HIGH_BASE;
+        bitmap += 1024;
+      } else {
+        // MSRs outside both ranges always exit
+        return -EINVAL;
+      }
+      for (uint64_t i = first; i < first + req->count; i++) {
+        if (req->trap)
+          __set_bit(i, (unsigned long*)bitmap);
+        else
+          __clear_bit(i, (unsigned long*)bitmap);
+      }
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+long get_vm_stats(struct vcpu* vcpu, struct proto_vm_stats* stats) {
+  if (!vcpu->vm_created)
+    return -ENOENT;
+  *stats = vcpu->stats;
+  stats->vpid = vcpu->vpid;
+  stats->vmx_nested = vmx_nested;
+  stats->vmcs_shadowing = vmcs_shadowing;
+  return 0;
+}
+
+// Sum of every CPU's counters; a CPU may be updating its own meanwhile
+void get_exit_stats(struct proto_exit_stats* stats) {
+  int cpu;
+
+  memset(stats, 0, sizeof(*stats));
+  for_each_possible_cpu(cpu) {
+    struct proto_exit_stats* percpu = per_cpu_ptr(&exit_stats, cpu);
+
+    for (int i = 0; i < PROTO_EXIT_REASONS; i++) {
+      stats->count[i] += READ_ONCE(percpu->count[i]);
+      stats->cycles[i] += READ_ONCE(percpu->cycles[i]);
+    }
+  }
+}
+
+static long int proto_ioctl(struct file* file, uint32_t cmd, unsigned long arg) {
+  struct vcpu* vcpu = file->private_data;
+  long ret;
+  struct proto_vm_config config;
+  struct proto_mem_load load;
+  struct proto_image_load image;
+  struct proto_vm_stats stats;
+  struct proto_intercept intercept;
+  struct proto_dirty_log dirty_log;
+  struct proto_working_set working_set;
+  struct proto_shared_image shared_image;
+  struct proto_image_map image_map;
+  struct proto_exit_stats* exit_stats;
+
+  // module-wide, so it needs no vCPU lock
+  if (cmd == PROTO_GET_EXIT_STATS) {
+    exit_stats = kmalloc(sizeof(*exit_stats), GFP_KERNEL);
+    if (!exit_stats)
+      return -ENOMEM;
+    get_exit_stats(exit_stats);
+    ret = copy_to_user((void __user *)arg, exit_stats, sizeof(*exit_stats)) ? -EFAULT : 0;
+    kfree(exit_stats);
+    return ret;
+  }
+  if (cmd == PROTO_CREATE_SHARED_IMAGE) {
+    if (copy_from_user(&shared_image, (void __user *)arg, sizeof(shared_image)))
+      return -EFAULT;
+    ret = create_shared_image(&shared_image);
+    // the descriptor is already installed, closing it is up to the caller
+    if (!ret && copy_to_user((void __user *)arg, &shared_image, sizeof(shared_image)))
+      ret = -EFAULT;
+    return ret;
+  }
+
+  ret = mutex_lock_interruptible(&vcpu->lock);
+  if (ret) {
+    pr_err("Mutex lock failed: %ld\n", ret);
+    return ret;
+  }
+
+  switch (cmd) {
+    case PROTO_CREATE_VM:
+      if (copy_from_user(&config, (void __user *)arg, sizeof(config))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = create_vm(vcpu, &config);
+      break;
+    case PROTO_LOAD_MEM:
+      if (copy_from_user(&load, (void __user *)arg, sizeof(load))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = load_guest_memory(vcpu, &load);
+      break;
+    case PROTO_LOAD_IMAGE:
+      if (copy_from_user(&image, (void __user *)arg, sizeof(image))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = load_guest_image(vcpu, &image);
+      if (!ret && copy_to_user((void __user *)arg, &image, sizeof(image)))
+        ret = -EFAULT;
+      break;
+    case PROTO_RUN:
+      ret = run_vm(vcpu);
+      break;
+    case PROTO_DESTROY_VM:
+      ret = destroy_vm(vcpu);
+      break;
+    case PROTO_GET_STATS:
+      ret = get_vm_stats(vcpu, &stats);
+      if (!ret && copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+        ret = -EFAULT;
+      break;
+    case PROTO_SET_INTERCEPT:
+      if (copy_from_user(&intercept, (void __user *)arg, sizeof(intercept))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = set_intercept(vcpu, &intercept);
+      break;
+    case PROTO_SNAPSHOT:
+      ret = take_snapshot(vcpu);
+      break;
+    case PROTO_RESET:
+      ret = reset_to_snapshot(vcpu);
+      break;
+    case PROTO_GET_DIRTY_LOG:
+      if (copy_from_user(&dirty_log, (void __user *)arg, sizeof(dirty_log))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = get_dirty_log(vcpu, &dirty_log);
+      if (!ret && copy_to_user((void __user *)arg, &dirty_log, sizeof(dirty_log)))
+        ret = -EFAULT;
+      break;
+    case PROTO_GET_WORKING_SET:
+      if (copy_from_user(&working_set, (void __user *)arg, sizeof(working_set))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = get_working_set(vcpu, &working_set);
+      if (!ret && copy_to_user((void __user *)arg, &working_set, sizeof(working_set)))
+        ret = -EFAULT;
+      break;
+    case PROTO_MAP_SHARED_IMAGE:
+      if (copy_from_user(&image_map, (void __user *)arg, sizeof(image_map))) {
+        ret = -EFAULT;
+        break;
+      }
+      ret = map_shared_image(vcpu, &image_map);
+      break;
+    default:
+      ret = -ENOTTY;
+      break;
+  }
+  mutex_unlock(&vcpu->lock);
+
+  return ret;
+}
+
+static void proto_vm_open(struct vm_area_struct* vma) {
+  struct vcpu* vcpu = vma->vm_private_data;
+
+  spin_lock(&vcpu->mem_lock);
+  vcpu->mmap_count++;
+  spin_unlock(&vcpu->mem_lock);
+}
+
+static void proto_vm_close(struct vm_area_struct* vma) {
+  struct vcpu* vcpu = vma->vm_private_data;
+
+  spin_lock(&vcpu->mem_lock);
+  vcpu->mmap_count--;
+  spin_unlock(&vcpu->mem_lock);
+}
+
+// Guest RAM is mapped a page at a time as userspace touches it; touching
+// an unbacked region populates it just like a guest demand fault.
+static vm_fault_t proto_vm_fault(struct vm_fault* vmf) {
+  struct vcpu* vcpu = vmf->vma->vm_private_data;
+  uint64_t gpa = (uint64_t)vmf->pgoff << PAGE_SHIFT;
+  uint8_t* chunk;
+
+  if (gpa >= vcpu->vm_memory_size)
+    return VM_FAULT_SIGBUS;
+  if (!populate_guest_region(vcpu, gpa, GFP_KERNEL))
+    return VM_FAULT_OOM;
+  chunk = READ_ONCE(vcpu->vm_chunks[gpa / GUEST_CHUNK_SIZE]);
+  return vmf_insert_pfn(vmf->vma, vmf->address,
+                        virt_to_phys(chunk + gpa % GUEST_CHUNK_SIZE) >> PAGE_SHIFT);
+}
+
+static const struct vm_operations_struct proto_vm_ops = {
+  .open = proto_vm_open,
+  .close = proto_vm_close,
+  .fault = proto_vm_fault,
+};
+
+// File offset N maps GPA N. Takes mem_lock rather than vcpu->lock: mmap()
+// runs under mmap_lock, which ioctls holding vcpu->lock may need for
+// copy_from_user.
+static int proto_mmap(struct file* file, struct vm_area_struct* vma) {
+  struct vcpu* vcpu = file->private_data;
+  uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+  uint64_t size = vma->vm_end - vma->vm_start;
+
+  if (!(vma->vm_flags & VM_SHARED))
+    return -EINVAL;
+
+  // the run page is not guest memory and does not pin the VM
+  if (offset == PROTO_RUN_PAGE_OFFSET) {
+    if (size != PAGE_SIZE)
+      return -EINVAL;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(vcpu->run) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot);
+  }
+
+  spin_lock(&vcpu->mem_lock);
+  if (!vcpu->vm_created || offset > vcpu->vm_memory_size ||
+      size > vcpu->vm_memory_size - offset) {
+    spin_unlock(&vcpu->mem_lock);
+    return -EINVAL;
+  }
+  vcpu->mmap_count++;
+  spin_unlock(&vcpu->mem_lock);
+
+  vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+  vma->vm_ops = &proto_vm_ops;
+  vma->vm_private_data = vcpu;
+  return 0;
+}
+
+// Every open file descriptor is an independent vCPU with its own VM
+static int proto_open(struct inode* inode, struct file* file) {
+  struct vcpu* vcpu = kzalloc(sizeof(*vcpu), GFP_KERNEL);
+
+  if (!vcpu)
+    return -ENOMEM;
+  BUILD_BUG_ON(sizeof(struct proto_run) > PAGE_SIZE);
+  vcpu->run = (struct proto_run*)get_zeroed_page(GFP_KERNEL);
+  if (!vcpu->run) {
+    kfree(vcpu);
+    return -ENOMEM;
+  }
+  vcpu->cpu = -1;
+  mutex_init(&vcpu->lock);
+  spin_lock_init(&vcpu->mem_lock);
+  spin_lock_init(&vcpu->console_lock);
+  INIT_LIST_HEAD(&vcpu->console_node);
+  file->private_data = vcpu;
+  return 0;
+}
+
+// Mappings hold a file reference, so none are left by the time this runs
+static int proto_release(struct inode* inode, struct file* file) {
+  struct vcpu* vcpu = file->private_data;
+
+  if (vcpu->vm_created)
+    destroy_vm(vcpu);
+  free_page((unsigned long)vcpu->run);
+  kfree(vcpu);
+  return 0;
+}
+
+static const struct file_operations my_driver_fops = {
+    .owner = THIS_MODULE,
+    .open = proto_open,
+    .release = proto_release,
+    .unlocked_ioctl = proto_ioctl,
+    .mmap = proto_mmap,
+};
+
+int __init start_init(void)
+{
+  int ret;
+  if (!page_pools_init())
+    return -ENOMEM;
+  if (!vmxSupport()) {
+		printk(KERN_INFO "VMX support not present! EXITING");
+    ret = -ENODEV;
+    goto drain_pools;
+	}
+	else {
+		printk(KERN_INFO "VMX support present! CONTINUING");
+	}
+	if (!getVmxOperation()) {
+		printk(KERN_INFO "VMX Operation failed! EXITING");
+    ret = -EIO;
+    goto drain_pools;
+	}
+	else {
+		printk(KERN_INFO "VMX Operation succeeded! CONTINUING");
+	}
+  ret = alloc_chrdev_region(&dev, 0, 1, "protovirt");
+  if (ret < 0) {
+      pr_err("Failed to allocate chrdev region\n");
+      goto vmx_off;
+  }
+
+  my_cdev = cdev_alloc();
+  if (!my_cdev) {
+      ret = -ENOMEM;
+      goto unregister_region;
+  }
+
+  cdev_init(my_cdev, &my_driver_fops);
+  my_cdev->owner = THIS_MODULE;
+
+  ret = cdev_add(my_cdev, dev, 1);
+  if (ret < 0) {
+      pr_err("Failed to add cdev\n");
+      goto del_cdev;
+  }
+
+  my_class = class_create("proto_class");
+  if (IS_ERR(my_class)) {
+      pr_err("Failed to create class: %ld\n", PTR_ERR(my_class));
+      ret = PTR_ERR(my_class);
+      goto del_cdev;
+  }
+
+  // Step 4: Create a device instance (triggers udev)
+  my_device = device_create(my_class, NULL, dev, NULL, "proto");
+  if (IS_ERR(my_device)) {
+      pr_err("Failed to create device: %ld\n", PTR_ERR(my_device));
+      ret = PTR_ERR(my_device);
+      goto destroy_class;
+  }
+
+  // without it, guest consoles are only printed after each run
+  console_thread = kthread_run(console_thread_fn, NULL, "proto-console");
+  if (IS_ERR(console_thread)) {
+      pr_err("Failed to start the console thread: %ld\n", PTR_ERR(console_thread));
+      console_thread = NULL;
+  }
+
+  pr_info("Proto driver initialized\n");
+  return 0;
+
+  // end_exit() is not called after a failed init, so undo everything here
+destroy_class:
+  class_destroy(my_class);
+del_cdev:
+  cdev_del(my_cdev);
+unregister_region:
+  unregister_chrdev_region(dev, 1);
+vmx_off:
+  vmxoffOperation();
+drain_pools:
+  page_pools_drain();
+  return ret;
+}
+
+static void __exit end_exit(void)
+{
+  printk(KERN_INFO "Unloading the driver\n");
+  if (console_thread)
+    kthread_stop(console_thread);
+  if (!vmxoffOperation()) {
+		printk(KERN_INFO "VMXOFF operation failed! EXITING");
+		return;
+	}
+	else {
+		printk(KERN_INFO "VMXOFF Operation succeeded! CONTINUING\n");
+	}
+  device_destroy(my_class, dev);
+  class_destroy(my_class);
+  cdev_del(my_cdev);
+  unregister_chrdev_region(dev, 1);
+  ida_destroy(&vpid_ida);
+  page_pools_drain();
+  printk(KERN_INFO "Driver unloaded\n");
+	return;
+}
+
+module_init(start_init);
 module_exit(end_exit);
 
 // CH 23.7, Vol 3
 // Enter in VMX mode
-bool allocVmcsRegion(void) {
+bool allocVmcsRegion(struct vcpu* vcpu) {
   uint64_t temp_region;
-  if (!cpu.vmcsRegion) {
-    cpu.vmcsRegion = kzalloc(MYPAGE_SIZE,GFP_KERNEL);
+  if (!vcpu->vmcsRegion) {
+    vcpu->vmcsRegion = pool_alloc(POOL_PAGE, vcpu->node, GFP_KERNEL | __GFP_ZERO);
   } else {
-    temp_region = (uint64_t)cpu.vmcsRegion;
-    cpu.vmcsRegion = kzalloc(MYPAGE_SIZE, GFP_KERNEL);
-    kfree((void*)temp_region);
+    temp_region = (uint64_t)vcpu->vmcsRegion;
+    vcpu->vmcsRegion = pool_alloc(POOL_PAGE, vcpu->node, GFP_KERNEL | __GFP_ZERO);
+    pool_free(POOL_PAGE, (void*)temp_region);
   }
-  if (cpu.vmcsRegion == NULL){
+  if (vcpu->vmcsRegion == NULL){
 		printk(KERN_INFO "Error allocating vmcs region\n");
     return false;
   }
@@ -687,59 +3024,66 @@ uint32_t vmExit_reason(void) {
 	return exit_reason;
 }
 
-// Dealloc vmxon region
+// Dealloc vmxon regions of every CPU
 bool deallocate_vmxon_region(void) {
-	if(cpu.vmxonRegion){
-	    kfree(cpu.vmxonRegion);
-      cpu.vmxonRegion = 0;
-		return true;
+  bool freed = false;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    if (per_cpu(vmxon_region, cpu)) {
+      pool_free(POOL_PAGE, per_cpu(vmxon_region, cpu));
+      per_cpu(vmxon_region, cpu) = 0;
+      freed = true;
+    }
   }
-  return false;
+  return freed;
 }
 
 /* Dealloc vmcs guest region*/
-bool deallocate_vmcs_region(void) {
-	if(cpu.vmcsRegion) {
+bool deallocate_vmcs_region(struct vcpu* vcpu) {
+  // the bitmaps are only referenced from the VMCS
+  kfree(vcpu->io_bitmap_a);
+  kfree(vcpu->io_bitmap_b);
+  kfree(vcpu->msr_bitmap);
+  vcpu->io_bitmap_a = vcpu->io_bitmap_b = vcpu->msr_bitmap = 0;
+  free_page((unsigned long)vcpu->pml_log);
+  vcpu->pml_log = 0;
+	if(vcpu->vmcsRegion) {
     	printk(KERN_INFO "Freeing allocated vmcs region!\n");
-    	kfree(cpu.vmcsRegion);
-      cpu.vmcsRegion = 0;
+    	pool_free(POOL_PAGE, vcpu->vmcsRegion);
+      vcpu->vmcsRegion = 0;
 		return true;
 	}
 	return false;
 }
 
-bool deallocate_guest_memory(void) {
-  if (cpu.vm_memory) {
-    kfree(cpu.vm_memory);
-    cpu.vm_memory = 0;
-  } else {
-    return false;
+// Also used to unwind a partially created VM, so each part is optional
+bool deallocate_guest_memory(struct vcpu* vcpu) {
+  bool freed = false;
+
+  free_snapshot(vcpu, vcpu->snapshot);
+  vcpu->snapshot = NULL;
+  kvfree(vcpu->dirty_log);
+  vcpu->dirty_log = NULL;
+  if (vcpu->guest_fpu)
+    free_pages_exact(vcpu->guest_fpu, guest_fpu_size);
+  vcpu->guest_fpu = NULL;
+  if (vcpu->vm_chunks) {
+    for (uint64_t i = 0; i < DIV_ROUND_UP(vcpu->vm_memory_size, GUEST_CHUNK_SIZE); i++)
+      free_guest_chunk(vcpu->vm_chunks[i]);
+    kvfree(vcpu->vm_chunks);
+    vcpu->vm_chunks = 0;
+    freed = true;
   }
-  if (cpu.pml4) {
-    kfree(cpu.pml4);
-    cpu.pml4 = 0;
-  } else {
-    return false;
+  free_guest_chunk(vcpu->spare_chunk);
+  vcpu->spare_chunk = 0;
+  if (vcpu->pml4) {
+    detach_shared_image(vcpu);
+    ept_free_tables(&ept_ops, vcpu->pml4);
+    vcpu->pml4 = 0;
+    freed = true;
   }
-  if (cpu.pml3) {
-    kfree(cpu.pml3);
-    cpu.pml3 = 0;
-  } else {
-    return false;
-  }
-  if (cpu.pml2) {
-    kfree(cpu.pml2);
-    cpu.pml2 = 0;
-  } else {
-    return false;
-  }
-  if (cpu.pml1) {
-    kfree(cpu.pml1);
-    cpu.pml1 = 0;
-  } else {
-    return false;
-  }
-  return true;
+  return freed;
 }
 
 MODULE_LICENSE("GPL");
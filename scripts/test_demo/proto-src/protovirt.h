@@ -1,7 +1,8 @@
 #include <asm/asm.h>
 #include <asm/io.h>
 #include "macro.h"
-#include "ept.h"
+#include "paging.h"
+#include "proto_ioctl.h"
 
 struct desc64 {
 	uint16_t limit0;
@@ -12,21 +13,6 @@ struct desc64 {
 	uint32_t zero1;
 } __attribute__((packed));
 
-typedef struct guest_page_table_entry {
-    uint64_t Present : 1;          // Bit 0: Present
-    uint64_t ReadWrite : 1;       // Bit 1: Read/Write
-    uint64_t UserSupervisor : 1;  // Bit 2: User/Supervisor
-    uint64_t WriteThrough : 1;    // Bit 3: PWT
-    uint64_t CacheDisable : 1;    // Bit 4: PCD
-    uint64_t Accessed : 1;        // Bit 5: Accessed
-    uint64_t Dirty : 1;           // Bit 6: Dirty (for PT entries)
-    uint64_t PageSize : 1;        // Bit 7: PS (for PDPT/PD)
-    uint64_t Ignored1 : 4;        // Bits 11:8 (Protection Key or Ignored)
-    uint64_t PhysicalAddress : 40; // Bits 51:12
-    uint64_t Available : 7;      // Bits 62:52 (Available for software)
-    uint64_t NoExecute : 1;       // Bit 63: NX
-    uint64_t Reserved : 4;       // Bit 63: NX
-} guest_page_table_entry;
 
 union __rflags_t
 {
@@ -82,22 +68,129 @@ typedef struct spec_regs {
   uint64_t rip;
 } spec_regs;
 
+#define VM_SNAPSHOT_FIELDS 52
+
+struct vm_snapshot {
+  // copy of every chunk that was backed at snapshot time, NULL for the rest
+  uint8_t** chunks;
+  // chunks with pages written since the snapshot or the last reset
+  unsigned long* dirty_bitmap;
+  uint32_t* dirty_chunks;
+  uint64_t nr_dirty;
+  gen_regs regs;
+  uint64_t fields[VM_SNAPSHOT_FIELDS];
+  struct proto_hc_ring* hc_ring;
+  uint64_t hc_ring_gpa;
+  uint64_t console_gpa;
+  uint8_t* guest_fpu;
+};
+
+// A guest image shared read-only by every VM that maps it, see
+// create_shared_image(). Its EPT maps the image at GPA 0 with read-only
+// 2MB leaves; the page directory of each 1GB is linked into the EPT of the
+// VMs as is, until one of them writes there.
+struct shared_image {
+  struct kref ref;
+  uint64_t size;
+  uint64_t nr_chunks;
+  EPT_PML4_ENTRY* pml4;
+  EPT_PML2_ENTRY* pds[SHARED_IMAGE_MAX_SIZE / GUEST_PAGE_SIZE_1GB];
+  uint8_t* chunks[];
+};
+
 typedef struct vcpu {
   gen_regs guest_gen_regs;
   gen_regs host_gen_regs;
   
-  uint64_t* vmxonRegion;
   uint64_t* vmcsRegion;
-  uint8_t* vm_memory;
-
+  // one page each, a set bit makes the port or MSR access exit
+  uint8_t* io_bitmap_a;
+  uint8_t* io_bitmap_b;
+  uint8_t* msr_bitmap;
+  // CPU the VMCS is active on, -1 while it is clear, and whether it was
+  // launched there; see vcpu_load()
+  int cpu;
+  bool launched;
+  // HOST_CR4 as last written, see refresh_host_state()
+  unsigned long host_cr4;
+  // NUMA node the VM's pages are allocated on, see pool_alloc()
+  int node;
+  // 0 when the VM runs without VPID, see vcpu_flush_tlb()
+  uint16_t vpid;
+  uint64_t eptp;
+  // the EPT or guest page tables changed since the last flush
+  bool tlb_dirty;
+  // a run ends at the latest time_slice_tsc TSC ticks after it started,
+  // see arm_preemption_timer()
+  uint64_t time_slice_tsc;
+  uint64_t slice_deadline;
+  // the last run was preempted or exited to userspace mid-guest, the next
+  // one continues the guest
+  bool resume_pending;
+  // I/O or MSR exit the next run completes, 0 for none; its qualification
+  // and instruction length. See complete_user_exit().
+  uint32_t pending_exit;
+  uint64_t pending_qual;
+  uint64_t pending_len;
+  // the last entry ended in an exit the run loop enters the guest again
+  // after, once the host has taken its interrupt; see run_vm()
+  bool reenter;
+  // where a run starts otherwise, set by PROTO_LOAD_IMAGE
+  uint64_t entry_rip;
+  uint64_t entry_rsp;
+  // serializes the ioctls of the file descriptor owning this vCPU
+  struct mutex lock;
+  // guest memory is backed in 2MB chunks on demand, see populate_guest_region()
+  uint8_t** vm_chunks;
+  uint8_t* spare_chunk;
+  uint64_t vm_memory_size;
+  bool vm_created;
+  // protects vm_chunks, spare_chunk, the EPT, vm_created and mmap_count
+  spinlock_t mem_lock;
+  unsigned int mmap_count;
+  struct proto_vm_stats stats;
+  // shared with userspace through mmap() at PROTO_RUN_PAGE_OFFSET
+  struct proto_run* run;
+  // registered by the guest with PROTO_HC_RING_SETUP, NULL until then
+  struct proto_hc_ring* hc_ring;
+  uint64_t hc_ring_gpa;
+  // range of the last PROTO_HC_POPULATE, backed by the run loop before the
+  // guest resumes; populate_end is 0 when there is none
+  uint64_t populate_gpa;
+  uint64_t populate_end;
+  // registered by the guest with PROTO_HC_CONSOLE_SETUP, NULL until then,
+  // at stats.console_gpa. console_lock protects it, console_size and
+  // console_tail, the position of the next byte to print, and is taken on
+  // the exit path; see drain_console().
+  struct proto_console_ring* console;
+  uint32_t console_size;
+  uint32_t console_tail;
+  bool user_console;
+  spinlock_t console_lock;
+  // on console_vcpus while the VM exists
+  struct list_head console_node;
+  // set by PROTO_SNAPSHOT, see take_snapshot()
+  struct vm_snapshot* snapshot;
+  // guest x87/SSE/AVX state while it is not in the registers; it is loaded
+  // on the first use in a run, and before every later entry in that run
+  // once fpu_wanted is set; see guest_fpu_load()
+  uint8_t* guest_fpu;
+  bool fpu_loaded;
+  bool fpu_wanted;
+  // set by PROTO_MAP_SHARED_IMAGE: the image at image_gpa, and one bit per
+  // 1GB of it whose page directory is still the image's own
+  struct shared_image* image;
+  uint64_t image_gpa;
+  uint64_t shared_windows;
+  // with PROTO_VM_DIRTY_LOG: the page the CPU logs written GPAs to, and
+  // one bit per guest page collected from it, see drain_pml_log()
+  uint64_t* pml_log;
+  unsigned long* dirty_log;
+
+  // lower EPT levels are allocated on demand by ept_map_range()
   EPT_PML4_ENTRY* pml4;
-  EPT_PML3_ENTRY* pml3;
-  EPT_PML2_ENTRY* pml2;
-  EPT_PML1_ENTRY* pml1;
 } vcpu;
 
-struct vcpu cpu = {0};
-
 static inline unsigned long long notrace __rdmsr1(unsigned int msr)
 {
   return __rdmsr(msr);
@@ -179,6 +272,47 @@ static inline int _vmptrld(uint64_t vmcs_pa)
 	return ret;
 }
 
+// CH 30.3, Vol 3
+// VMCLEAR flushes the VMCS to memory and resets its launch state to clear
+static inline int _vmclear(uint64_t vmcs_pa)
+{
+	uint8_t ret;
+
+	__asm__ __volatile__ ("vmclear %[pa]; setna %[ret]"
+		: [ret]"=rm"(ret)
+		: [pa]"m"(vmcs_pa)
+		: "cc", "memory");
+	return ret;
+}
+
+// CH 30.3, Vol 3
+// Invalidate cached mappings derived from an EPTP, on this CPU only
+static inline int _invept(uint64_t type, uint64_t eptp)
+{
+	struct { uint64_t eptp, reserved; } desc = { eptp, 0 };
+	uint8_t ret;
+
+	__asm__ __volatile__ ("invept %[desc], %[type]; setna %[ret]"
+		: [ret]"=rm"(ret)
+		: [desc]"m"(desc), [type]"r"(type)
+		: "cc", "memory");
+	return ret;
+}
+
+// CH 30.3, Vol 3
+// Invalidate cached linear mappings tagged with a VPID, on this CPU only
+static inline int _invvpid(uint64_t type, uint16_t vpid, uint64_t gva)
+{
+	struct { uint64_t vpid, gva; } desc = { vpid, gva };
+	uint8_t ret;
+
+	__asm__ __volatile__ ("invvpid %[desc], %[type]; setna %[ret]"
+		: [ret]"=rm"(ret)
+		: [desc]"m"(desc), [type]"r"(type)
+		: "cc", "memory");
+	return ret;
+}
+
 // Ch A.2, Vol 3
 // indicate whether any of the default1 controls may be 0
 // if return 0, all the default1 controls are reserved and must be 1.
@@ -191,29 +325,102 @@ static inline uint64_t get_desc64_base(const struct desc64 *desc)
 		(desc->base0 | ((desc->base1) << 16) | ((desc->base2) << 24));
 }
 
-extern inline void _vmlaunch(gen_regs* regs, uint64_t vmexit_addr);
+extern inline void _vmlaunch(gen_regs* regs, uint64_t vmexit_addr, gen_regs* guest_regs);
+void _vmresume(gen_regs* guest_regs);
 extern inline void clear_regs(void);
 extern inline void save_regs(gen_regs* regs);
 extern inline void restore_regs(gen_regs* regs);
+// Enter the guest with VMLAUNCH, or VMRESUME if launched, and resume it
+// after every exit that vmexit_dispatch() handles. Returns 1 if VMLAUNCH or
+// VMRESUME failed.
+uint32_t proto_vcpu_run(struct vcpu* vcpu, bool launched);
+bool vmexit_dispatch(struct vcpu* vcpu);
 
 // Function prototypes
 bool vmxSupport(void);
 bool getVmxOperation(void);
-bool vmcsOperations(void);
+bool vmcsOperations(struct vcpu* vcpu);
 bool vmxoffOperation(void);
-uint64_t init_ept(void);
-void setup_guest_page_tables(void* page_table_addr);
-bool initVmcsControlField(void);
-uint32_t vmresume(void);
+uint8_t* alloc_guest_chunk(int node, gfp_t gfp);
+void free_guest_chunk(uint8_t* chunk);
+bool populate_guest_region(struct vcpu* vcpu, uint64_t gpa, gfp_t gfp);
+uint64_t init_ept(struct vcpu* vcpu);
+bool setup_guest_page_tables(struct vcpu* vcpu);
+bool initVmcsControlField(struct vcpu* vcpu);
+bool skip_guest_instruction(void);
+uint32_t vmresume(struct vcpu* vcpu);
+bool handle_ept_violation(struct vcpu* vcpu);
+bool handle_vmcall(struct vcpu* vcpu);
+bool handle_cpuid(struct vcpu* vcpu);
+void record_exit(struct vcpu* vcpu, uint32_t exit_reason);
+bool arm_preemption_timer(struct vcpu* vcpu);
 void vmexit_handler(void);
-bool initVmLaunchProcess(void);
+bool initVmLaunchProcess(struct vcpu* vcpu);
+void refresh_host_state(struct vcpu* vcpu);
+void reset_guest_entry_state(struct vcpu* vcpu);
+void refresh_host_cpu_state(void);
+bool vcpu_load(struct vcpu* vcpu, int cpu);
+void vcpu_clear(struct vcpu* vcpu);
+void vcpu_flush_tlb(struct vcpu* vcpu);
+long create_vm(struct vcpu* vcpu, struct proto_vm_config* config);
+long load_guest_memory(struct vcpu* vcpu, struct proto_mem_load* load);
+long load_guest_image(struct vcpu* vcpu, struct proto_image_load* image);
+long run_vm(struct vcpu* vcpu);
+long take_snapshot(struct vcpu* vcpu);
+long reset_to_snapshot(struct vcpu* vcpu);
+void free_snapshot(struct vcpu* vcpu, struct vm_snapshot* snap);
+bool map_snapshot_chunk(struct vcpu* vcpu, uint64_t gpa);
+bool mark_page_dirty(struct vcpu* vcpu, uint64_t gpa, bool from_host);
+void drain_pml_log(struct vcpu* vcpu);
+long get_dirty_log(struct vcpu* vcpu, struct proto_dirty_log* log);
+long get_working_set(struct vcpu* vcpu, struct proto_working_set* ws);
+long create_shared_image(struct proto_shared_image* req);
+long map_shared_image(struct vcpu* vcpu, struct proto_image_map* req);
+void detach_shared_image(struct vcpu* vcpu);
+long destroy_vm(struct vcpu* vcpu);
+long get_vm_stats(struct vcpu* vcpu, struct proto_vm_stats* stats);
+long set_intercept(struct vcpu* vcpu, struct proto_intercept* req);
+bool alloc_intercept_bitmaps(struct vcpu* vcpu);
+bool alloc_dirty_log(struct vcpu* vcpu);
+bool alloc_guest_fpu(struct vcpu* vcpu);
+void guest_fpu_put(struct vcpu* vcpu);
+void get_exit_stats(struct proto_exit_stats* stats);
 int __init start_init(void);
-bool allocVmcsRegion(void);
+bool allocVmcsRegion(struct vcpu* vcpu);
 unsigned long long default1_controls(void);
 uint32_t vmExit_reason(void);
 bool deallocate_vmxon_region(void);
-bool deallocate_vmcs_region(void);
-bool deallocate_guest_memory(void);
+bool deallocate_vmcs_region(struct vcpu* vcpu);
+bool deallocate_guest_memory(struct vcpu* vcpu);
+
+// CH 13.3, Vol 1
+static inline uint64_t xgetbv1(uint32_t index)
+{
+	uint32_t eax, edx;
+
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return eax | ((uint64_t)edx << 32);
+}
+
+// CH 13.7-13.9, Vol 1: XSAVE area at buf, components in mask
+static inline void xsave_area(void* buf, uint64_t mask, bool opt)
+{
+	if (opt)
+		__asm__ __volatile__("xsaveopt64 (%0)"
+				     : : "r"(buf), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32))
+				     : "memory");
+	else
+		__asm__ __volatile__("xsave64 (%0)"
+				     : : "r"(buf), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32))
+				     : "memory");
+}
+
+static inline void xrstor_area(void* buf, uint64_t mask)
+{
+	__asm__ __volatile__("xrstor64 (%0)"
+			     : : "r"(buf), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32))
+			     : "memory");
+}
 
 static inline uint64_t get_cr0(void)
 {
@@ -0,0 +1,1442 @@
+/*
+ * Proto Benchmark Program
+ *
+ * Measures the latency of running a tiny guest through /dev/proto:
+ * 1. "cold": create, load, run and destroy the VM on every iteration,
+ *    which is what the old single-ioctl interface did per call
+ * 2. "warm": create once, load the image through an mmap() of guest
+ *    RAM, then only PROTO_RUN per iteration
+ * 3. "hc-exit"/"hc-ring": 64 no-op hypercalls per run, issued as 64
+ *    VMCALLs or queued in the hypercall ring behind a single doorbell
+ * 4. "vpid-on"/"vpid-off": a guest that writes 256 4K pages between
+ *    64 exits, with and without VPID, i.e. with its TLB entries kept or
+ *    flushed across every exit
+ * 5. "slice": a guest spinning forever under a 1ms time slice; every
+ *    PROTO_RUN must come back preempted after about that long
+ * 6. "scale": 1..N processes, each pinned to its own CPU with its own
+ *    /dev/proto file (and therefore its own vCPU), run warm in parallel;
+ *    reports the aggregate run rate for every N
+ * 7. "snap": PROTO_RUN then PROTO_RESET to a snapshot, for a guest that
+ *    dirties 1, 16 or 256 pages per run, in 2MB and 1GB of guest RAM;
+ *    reports the cost of the reset alone
+ * 8. "dirty": the same guest writing 256 or 4096 pages of a 1GB VM
+ *    created with PROTO_VM_DIRTY_LOG; reports the cost of collecting the
+ *    PML dirty log after each run and checks that it has those pages
+ * 9. "fpu": a guest that keeps a value in xmm0 across runs while this
+ *    process uses SSE in between; checks that neither side sees the
+ *    other's registers and reports how many runs loaded the guest state
+ * 10. "ws": the dirty-page guest writing 4096 pages of a 1GB VM; reports
+ *    the cost of PROTO_GET_WORKING_SET with PROTO_WS_CLEAR after each run,
+ *    the working set it found and the EPT tables it had to read
+ * 11. "vmcs-legacy"/"vmcs-template": the TSC cycles PROTO_CREATE_VM
+ *    spends initializing the VMCS field by field, reading host fields
+ *    back, and from the precomputed template. Run inside a VM (e.g. an
+ *    L1 guest of KVM) this shows what the VMREAD/VMWRITE exits cost.
+ * 12. "fleet": 1, 16 and 64 VMs booting the same 8MB image at 1GB, which
+ *    each guest reads a byte of per page, either mapped from one
+ *    PROTO_CREATE_SHARED_IMAGE or copied into every VM with PROTO_LOAD_MEM;
+ *    reports the setup cost per VM and the host memory the fleet uses
+ * 13. "console": a guest that writes 64 records per run to a console ring
+ *    without exiting, drained by this process through mmap() after each
+ *    run (compare hc-exit, 64 exits per run); first checks that the module
+ *    prints a line from a ring the guest registered
+ * 14. "latency": a process sleeping 1ms at a time on the CPU of a guest
+ *    that spins under a 200ms time slice; reports how late it wakes up,
+ *    then how soon a signal ends such a run
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "proto-src/proto_ioctl.h"
+
+#define DEFAULT_ITERATIONS 1000
+#define RUN_PAGE_SIZE 4096
+
+/* mov eax, 0; mov ebx, 42; vmcall; hlt
+ * (hypercall 0 is a no-op; 1 would printk ebx on every run) */
+static const uint8_t guest_code[] = {
+    0xb8, 0x00, 0x00, 0x00, 0x00,
+    0xbb, 0x2a, 0x00, 0x00, 0x00,
+    0x0f, 0x01, 0xc1,
+    0xf4,
+};
+
+/* mov ecx, 64; 1: xor eax, eax; vmcall; dec ecx; jnz 1b; hlt */
+static const uint8_t hc_exit_code[] = {
+    0xb9, 0x40, 0x00, 0x00, 0x00,
+    0x31, 0xc0,
+    0x0f, 0x01, 0xc1,
+    0xff, 0xc9,
+    0x75, 0xf7,
+    0xf4,
+};
+
+/* mov eax, PROTO_HC_RING_SETUP; mov ebx, 0x20000; vmcall;
+ * mov dword [0x20000], 64 (ring head: 64 zeroed, i.e. no-op, entries);
+ * mov eax, PROTO_HC_RING_KICK; vmcall; hlt */
+static const uint8_t hc_ring_code[] = {
+    0xb8, 0x04, 0x00, 0x00, 0x00,
+    0xbb, 0x00, 0x00, 0x02, 0x00,
+    0x0f, 0x01, 0xc1,
+    0xc7, 0x04, 0x25, 0x00, 0x00, 0x02, 0x00, 0x40, 0x00, 0x00, 0x00,
+    0xb8, 0x05, 0x00, 0x00, 0x00,
+    0x0f, 0x01, 0xc1,
+    0xf4,
+};
+
+/* 64 times: add byte [rsi], 1 for every 4K page in [1MB, 2MB), then a
+ * no-op vmcall; hlt */
+static const uint8_t touch_code[] = {
+    0x41, 0xb9, 0x40, 0x00, 0x00, 0x00,     /* mov r9d, 64 */
+    0xbe, 0x00, 0x00, 0x10, 0x00,           /* 2: mov esi, 0x100000 */
+    0xb9, 0x00, 0x01, 0x00, 0x00,           /* mov ecx, 256 */
+    0x80, 0x06, 0x01,                       /* 1: add byte [rsi], 1 */
+    0x81, 0xc6, 0x00, 0x10, 0x00, 0x00,     /* add esi, 0x1000 */
+    0xff, 0xc9,                             /* dec ecx */
+    0x75, 0xf3,                             /* jnz 1b */
+    0x31, 0xc0,                             /* xor eax, eax */
+    0x0f, 0x01, 0xc1,                       /* vmcall */
+    0x41, 0xff, 0xc9,                       /* dec r9d */
+    0x75, 0xdf,                             /* jnz 2b */
+    0xf4,                                   /* hlt */
+};
+#define TOUCH_ROUNDS 64
+#define TOUCH_PAGES 256
+
+/* The module's guest page tables map the default 2MB of guest RAM with one
+ * large page, which would need a single TLB entry. Split it into 4K pages:
+ * a page table at GUEST_PT, referenced from the PD the module put at
+ * 0x12000 (right after the PML4 and PDPT at 0x10000). */
+#define GUEST_PD 0x12000
+#define GUEST_PT 0x13000
+
+/* 1: jmp 1b */
+static const uint8_t spin_code[] = { 0xeb, 0xfe };
+
+/* add byte [rsi], 1 for [SNAP_COUNT] 4K pages from 1MB on; hlt */
+static const uint8_t dirty_code[] = {
+    0x8b, 0x0c, 0x25, 0x00, 0x00, 0x02, 0x00,   /* mov ecx, [0x20000] */
+    0xbe, 0x00, 0x00, 0x10, 0x00,               /* mov esi, 0x100000 */
+    0x80, 0x06, 0x01,                           /* 1: add byte [rsi], 1 */
+    0x81, 0xc6, 0x00, 0x10, 0x00, 0x00,         /* add esi, 0x1000 */
+    0xff, 0xc9,                                 /* dec ecx */
+    0x75, 0xf3,                                 /* jnz 1b */
+    0xf4,                                       /* hlt */
+};
+/* first run: xmm0 = [FPU_PATTERN], [FPU_FLAG] = 1; later runs:
+ * [FPU_OUT] = xmm0; hlt either way */
+static const uint8_t fpu_code[] = {
+    0x8b, 0x04, 0x25, 0x00, 0x00, 0x02, 0x00,   /* mov eax, [0x20000] */
+    0x85, 0xc0,                                 /* test eax, eax */
+    0x75, 0x15,                                 /* jnz 1f */
+    0xf3, 0x0f, 0x6f, 0x04, 0x25, 0x10, 0x00, 0x02, 0x00, /* movdqu xmm0, [0x20010] */
+    0xc7, 0x04, 0x25, 0x00, 0x00, 0x02, 0x00,
+    0x01, 0x00, 0x00, 0x00,                     /* mov dword [0x20000], 1 */
+    0xf4,                                       /* hlt */
+    0xf3, 0x0f, 0x7f, 0x04, 0x25, 0x20, 0x00, 0x02, 0x00, /* 1: movdqu [0x20020], xmm0 */
+    0xf4,                                       /* hlt */
+};
+#define FPU_FLAG 0x20000
+#define FPU_PATTERN 0x20010
+#define FPU_OUT 0x20020
+#define SNAP_COUNT 0x20000
+#define SNAP_PAGES 0x100000
+#define SLICE_US 1000
+#define SLICE_RUNS 100
+#define LATENCY_SLICE_US 200000
+#define LATENCY_SLEEP_NS 1000000
+#define LATENCY_WAKEUPS 200
+#define LATENCY_ALARM_US 10000
+#define LEGACY_VMCS_SETUP "/sys/module/proto/parameters/legacy_vmcs_setup"
+
+/* mov eax, FLEET_IMAGE_GPA; jmp rax */
+static const uint8_t fleet_stub[] = {
+    0xb8, 0x00, 0x00, 0x00, 0x40, 0xff, 0xe0,
+};
+/* mov esi, FLEET_IMAGE_GPA; mov ecx, pages;
+ * 1: mov al, [rsi]; add esi, 0x1000; dec ecx; jnz 1b; hlt */
+static const uint8_t fleet_code[] = {
+    0xbe, 0x00, 0x00, 0x00, 0x40,               /* mov esi, 0x40000000 */
+    0xb9, 0x00, 0x08, 0x00, 0x00,               /* mov ecx, 2048 */
+    0x8a, 0x06,                                 /* 1: mov al, [rsi] */
+    0x81, 0xc6, 0x00, 0x10, 0x00, 0x00,         /* add esi, 0x1000 */
+    0xff, 0xc9,                                 /* dec ecx */
+    0x75, 0xf4,                                 /* jnz 1b */
+    0xf4,                                       /* hlt */
+};
+#define FLEET_IMAGE_GPA (1ULL << 30)
+#define FLEET_IMAGE_SIZE (8ULL << 20)
+#define FLEET_MAX_VMS 64
+
+/* 64 times: [CONSOLE_RING data + head % 4096] = head as a qword, head += 8;
+ * hlt. The head is in the ring header, so it carries over between runs. */
+static const uint8_t console_code[] = {
+    0x8b, 0x3c, 0x25, 0x00, 0x00, 0x03, 0x00,   /* mov edi, [0x30000] */
+    0xb9, 0x40, 0x00, 0x00, 0x00,               /* mov ecx, 64 */
+    0x89, 0xf8,                                 /* 1: mov eax, edi */
+    0x25, 0xff, 0x0f, 0x00, 0x00,               /* and eax, 0xfff */
+    0x48, 0x89, 0xb8, 0x08, 0x00, 0x03, 0x00,   /* mov [rax + 0x30008], rdi */
+    0x83, 0xc7, 0x08,                           /* add edi, 8 */
+    0x89, 0x3c, 0x25, 0x00, 0x00, 0x03, 0x00,   /* mov [0x30000], edi */
+    0xff, 0xc9,                                 /* dec ecx */
+    0x75, 0xe4,                                 /* jnz 1b */
+    0xf4,                                       /* hlt */
+};
+/* register the ring at CONSOLE_RING; publish the CONSOLE_LINE already in
+ * it; hlt */
+static const uint8_t console_check_code[] = {
+    0xb8, 0x06, 0x00, 0x00, 0x00,               /* mov eax, PROTO_HC_CONSOLE_SETUP */
+    0xbb, 0x00, 0x00, 0x03, 0x00,               /* mov ebx, 0x30000 */
+    0x0f, 0x01, 0xc1,                           /* vmcall */
+    0xc7, 0x04, 0x25, 0x00, 0x00, 0x03, 0x00,
+    0x0e, 0x00, 0x00, 0x00,                     /* mov dword [0x30000], 14 */
+    0xf4,                                       /* hlt */
+};
+#define CONSOLE_RING 0x30000
+#define CONSOLE_SIZE 4096
+#define CONSOLE_LINE "proto console\n"
+#define CONSOLE_RECORDS 64
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, uint64_t *samples, int n)
+{
+    uint64_t sum = 0;
+    int i;
+
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    printf("%-8s iterations=%d min=%luns median=%luns mean=%luns max=%luns\n",
+           name, n, samples[0], samples[n / 2], sum / n, samples[n - 1]);
+}
+
+/* Exits and average handling cost per exit reason since *before */
+static void report_exits(int fd, const struct proto_exit_stats *before)
+{
+    struct proto_exit_stats after;
+    int i;
+
+    if (ioctl(fd, PROTO_GET_EXIT_STATS, &after) < 0) {
+        perror("PROTO_GET_EXIT_STATS failed");
+        return;
+    }
+    for (i = 0; i < PROTO_EXIT_REASONS; i++) {
+        uint64_t count = after.count[i] - before->count[i];
+        uint64_t cycles = after.cycles[i] - before->cycles[i];
+
+        if (count)
+            printf("exit     reason=%d count=%lu avg_cycles=%lu\n",
+                   i, count, cycles / count);
+    }
+}
+
+static int create_vm_size(int fd, uint64_t mem_size, uint64_t flags,
+                          uint64_t time_slice_us)
+{
+    struct proto_vm_config config = {
+        .mem_size = mem_size,
+        .flags = flags,
+        .time_slice_us = time_slice_us,
+    };
+
+    if (ioctl(fd, PROTO_CREATE_VM, &config) < 0) {
+        perror("PROTO_CREATE_VM failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int create_vm_config(int fd, uint64_t flags, uint64_t time_slice_us)
+{
+    return create_vm_size(fd, 0, flags, time_slice_us);
+}
+
+static int create_vm(int fd)
+{
+    return create_vm_config(fd, 0, 0);
+}
+
+static int create_and_load(int fd)
+{
+    struct proto_mem_load load = {
+        .guest_addr = 0,
+        .size = sizeof(guest_code),
+        .user_addr = (uintptr_t)guest_code,
+    };
+
+    if (create_vm(fd) < 0)
+        return -1;
+    if (ioctl(fd, PROTO_LOAD_MEM, &load) < 0) {
+        perror("PROTO_LOAD_MEM failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_cold(int fd, uint64_t *samples, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+
+        if (create_and_load(fd) < 0)
+            return -1;
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            return -1;
+        }
+        if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+            perror("PROTO_DESTROY_VM failed");
+            return -1;
+        }
+        samples[i] = now_ns() - start;
+    }
+    return 0;
+}
+
+static int bench_warm(int fd, uint64_t *samples, int n)
+{
+    struct proto_vm_stats stats;
+    struct proto_run *run;
+    uint64_t in_kernel = 0;
+    uint8_t *ram;
+    int i;
+
+    if (create_vm(fd) < 0)
+        return -1;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return -1;
+    }
+    memcpy(ram, guest_code, sizeof(guest_code));
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ,
+               MAP_SHARED, fd, PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            break;
+        }
+        samples[i] = now_ns() - start;
+        if (run->exit_reason != PROTO_EXIT_HLT) {
+            fprintf(stderr, "unexpected exit %u (hw %u) at rip 0x%llx\n",
+                    run->exit_reason, run->hw_exit_reason,
+                    (unsigned long long)run->regs.rip);
+            break;
+        }
+        in_kernel += run->in_kernel_exits;
+    }
+    munmap(run, RUN_PAGE_SIZE);
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (i < n)
+        return -1;
+    if (ioctl(fd, PROTO_GET_STATS, &stats) == 0)
+        printf("demand_faults=%llu resident_bytes=%llu in_kernel_exits=%llu\n",
+               (unsigned long long)stats.demand_faults,
+               (unsigned long long)stats.resident_bytes,
+               (unsigned long long)in_kernel);
+    return ioctl(fd, PROTO_DESTROY_VM);
+}
+
+static int bench_hypercalls(int fd, uint64_t *samples, int n)
+{
+    static const struct {
+        const char *name;
+        const uint8_t *code;
+        size_t size;
+    } guests[] = {
+        { "hc-exit", hc_exit_code, sizeof(hc_exit_code) },
+        { "hc-ring", hc_ring_code, sizeof(hc_ring_code) },
+    };
+    struct proto_vm_stats stats;
+    uint8_t *ram;
+    size_t g;
+    int i;
+
+    if (create_vm(fd) < 0)
+        return -1;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return -1;
+    }
+
+    for (g = 0; g < sizeof(guests) / sizeof(guests[0]); g++) {
+        memcpy(ram, guests[g].code, guests[g].size);
+        for (i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+
+            if (ioctl(fd, PROTO_RUN) < 0) {
+                perror("PROTO_RUN failed");
+                munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+                return -1;
+            }
+            samples[i] = now_ns() - start;
+        }
+        report(guests[g].name, samples, n);
+    }
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (ioctl(fd, PROTO_GET_STATS, &stats) == 0)
+        printf("ring_hypercalls=%llu\n", (unsigned long long)stats.hypercalls);
+    return ioctl(fd, PROTO_DESTROY_VM);
+}
+
+static int bench_vpid(int fd, uint64_t *samples, int n)
+{
+    static const struct {
+        const char *name;
+        uint64_t flags;
+    } modes[] = {
+        { "vpid-on", 0 },
+        { "vpid-off", PROTO_VM_NO_VPID },
+    };
+    struct proto_vm_stats stats;
+    uint64_t *pt;
+    uint8_t *ram;
+    size_t m;
+    int i;
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (create_vm_config(fd, modes[m].flags, 0) < 0)
+            return -1;
+        ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (ram == MAP_FAILED) {
+            perror("mmap of guest RAM failed");
+            return -1;
+        }
+        memcpy(ram, touch_code, sizeof(touch_code));
+        pt = (uint64_t *)(ram + GUEST_PT);
+        for (i = 0; i < 512; i++)
+            pt[i] = (uint64_t)i * 4096 | 0x3;                   /* P, RW */
+        *(uint64_t *)(ram + GUEST_PD) = GUEST_PT | 0x7;         /* P, RW, US */
+
+        for (i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+
+            if (ioctl(fd, PROTO_RUN) < 0) {
+                perror("PROTO_RUN failed");
+                munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+                return -1;
+            }
+            samples[i] = now_ns() - start;
+        }
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+        report(modes[m].name, samples, n);
+        if (ioctl(fd, PROTO_GET_STATS, &stats) == 0)
+            printf("vpid=%u tlb_flushes=%llu page_touches_per_sec=%.0f\n",
+                   stats.vpid, (unsigned long long)stats.tlb_flushes,
+                   TOUCH_ROUNDS * TOUCH_PAGES * 1e9 / samples[n / 2]);
+        if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+            perror("PROTO_DESTROY_VM failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int bench_slice(int fd, uint64_t *samples, int n)
+{
+    struct proto_run *run;
+    uint8_t *ram;
+    int i;
+
+    if (n > SLICE_RUNS)
+        n = SLICE_RUNS;
+    if (create_vm_config(fd, 0, SLICE_US) < 0)
+        return -1;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return -1;
+    }
+    memcpy(ram, spin_code, sizeof(spin_code));
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+               PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            break;
+        }
+        samples[i] = now_ns() - start;
+        if (run->exit_reason != PROTO_EXIT_PREEMPTED) {
+            fprintf(stderr, "spinning guest exited with %u (hw %u)\n",
+                    run->exit_reason, run->hw_exit_reason);
+            break;
+        }
+    }
+    munmap(run, RUN_PAGE_SIZE);
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (i < n)
+        return -1;
+    report("slice", samples, n);
+    return ioctl(fd, PROTO_DESTROY_VM);
+}
+
+static int bench_snapshot(int fd, uint64_t *samples, int n)
+{
+    static const uint32_t pages[] = { 1, 16, 256 };
+    static const uint64_t mem_sizes[] = { PROTO_DEFAULT_MEM_SIZE, 1ULL << 30 };
+    struct proto_vm_stats stats;
+    struct proto_run *run;
+    uint8_t *ram;
+    char name[32];
+    size_t p, m;
+    int i;
+
+    for (m = 0; m < sizeof(mem_sizes) / sizeof(mem_sizes[0]); m++) {
+        for (p = 0; p < sizeof(pages) / sizeof(pages[0]); p++) {
+            if (create_vm_size(fd, mem_sizes[m], 0, 0) < 0)
+                return -1;
+            ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+            if (ram == MAP_FAILED) {
+                perror("mmap of guest RAM failed");
+                return -1;
+            }
+            run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+                       PROTO_RUN_PAGE_OFFSET);
+            if (run == MAP_FAILED) {
+                perror("mmap of run page failed");
+                munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+                return -1;
+            }
+            memcpy(ram, dirty_code, sizeof(dirty_code));
+            *(uint32_t *)(ram + SNAP_COUNT) = pages[p];
+            if (ioctl(fd, PROTO_SNAPSHOT) < 0) {
+                perror("PROTO_SNAPSHOT failed");
+                break;
+            }
+
+            for (i = 0; i < n; i++) {
+                uint64_t start;
+
+                if (ioctl(fd, PROTO_RUN) < 0) {
+                    perror("PROTO_RUN failed");
+                    break;
+                }
+                if (run->exit_reason != PROTO_EXIT_HLT || ram[SNAP_PAGES] != 1) {
+                    fprintf(stderr, "run after reset: exit %u (hw %u), byte %u\n",
+                            run->exit_reason, run->hw_exit_reason,
+                            ram[SNAP_PAGES]);
+                    break;
+                }
+                start = now_ns();
+                if (ioctl(fd, PROTO_RESET) < 0) {
+                    perror("PROTO_RESET failed");
+                    break;
+                }
+                samples[i] = now_ns() - start;
+            }
+            munmap(run, RUN_PAGE_SIZE);
+            munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+            if (i < n)
+                return -1;
+            snprintf(name, sizeof(name), "snap-%u", pages[p]);
+            report(name, samples, n);
+            if (ioctl(fd, PROTO_GET_STATS, &stats) == 0)
+                printf("mem_size=%lluM reset_pages_per_run=%.1f\n",
+                       (unsigned long long)(mem_sizes[m] >> 20),
+                       (double)stats.reset_pages / n);
+            if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+                perror("PROTO_DESTROY_VM failed");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int bench_dirty_log(int fd, uint64_t *samples, int n)
+{
+    static const uint32_t pages[] = { 256, 4096 };
+    const uint64_t mem_size = 1ULL << 30;
+    struct proto_dirty_log log;
+    struct proto_vm_stats stats;
+    uint64_t *bitmap, dirty = 0;
+    uint8_t *ram;
+    char name[32];
+    size_t p;
+    int i;
+    uint32_t page;
+
+    bitmap = calloc(mem_size / 4096 / 64, sizeof(*bitmap));
+    if (!bitmap)
+        return -1;
+    log.bitmap = (uintptr_t)bitmap;
+    log.bitmap_size = mem_size / 4096 / 8;
+
+    for (p = 0; p < sizeof(pages) / sizeof(pages[0]); p++) {
+        struct proto_vm_config config = {
+            .mem_size = mem_size,
+            .flags = PROTO_VM_DIRTY_LOG,
+        };
+
+        if (ioctl(fd, PROTO_CREATE_VM, &config) < 0) {
+            free(bitmap);
+            if (errno == EOPNOTSUPP) {
+                printf("dirty    skipped, no PML on this CPU\n");
+                return 0;
+            }
+            perror("PROTO_CREATE_VM failed");
+            return -1;
+        }
+        ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (ram == MAP_FAILED) {
+            perror("mmap of guest RAM failed");
+            free(bitmap);
+            return -1;
+        }
+        memcpy(ram, dirty_code, sizeof(dirty_code));
+        *(uint32_t *)(ram + SNAP_COUNT) = pages[p];
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+
+        for (i = 0; i < n; i++) {
+            uint64_t start;
+
+            if (ioctl(fd, PROTO_RUN) < 0) {
+                perror("PROTO_RUN failed");
+                break;
+            }
+            start = now_ns();
+            if (ioctl(fd, PROTO_GET_DIRTY_LOG, &log) < 0) {
+                perror("PROTO_GET_DIRTY_LOG failed");
+                break;
+            }
+            samples[i] = now_ns() - start;
+            for (page = 0; page < pages[p]; page++) {
+                uint64_t bit = SNAP_PAGES / 4096 + page;
+
+                if (!(bitmap[bit / 64] & (1ULL << (bit % 64))))
+                    break;
+            }
+            if (page < pages[p]) {
+                fprintf(stderr, "dirty log misses page 0x%llx\n",
+                        (unsigned long long)(SNAP_PAGES + page * 4096ULL));
+                break;
+            }
+            dirty += log.dirty_pages;
+        }
+        if (i < n || ioctl(fd, PROTO_GET_STATS, &stats) < 0) {
+            free(bitmap);
+            return -1;
+        }
+        snprintf(name, sizeof(name), "dirty-%u", pages[p]);
+        report(name, samples, n);
+        printf("dirty_pages_per_run=%.1f pml_flushes_per_run=%.1f\n",
+               (double)dirty / n, (double)stats.pml_flushes / n);
+        dirty = 0;
+        if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+            perror("PROTO_DESTROY_VM failed");
+            free(bitmap);
+            return -1;
+        }
+    }
+    free(bitmap);
+    return 0;
+}
+
+static int bench_fpu(int fd, uint64_t *samples, int n)
+{
+    static const uint8_t pattern[16] = {
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+        0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+    };
+    struct proto_vm_stats stats;
+    struct proto_run *run;
+    volatile double x = 1.0;
+    uint8_t *ram;
+    int i;
+
+    if (create_vm(fd) < 0)
+        return -1;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return -1;
+    }
+    memcpy(ram, fpu_code, sizeof(fpu_code));
+    memcpy(ram + FPU_PATTERN, pattern, sizeof(pattern));
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ,
+               MAP_SHARED, fd, PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t start;
+
+        /* put something else in our own SSE registers */
+        x = x * 1.000001 + i;
+        memset(ram + FPU_OUT, 0, sizeof(pattern));
+        start = now_ns();
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            break;
+        }
+        samples[i] = now_ns() - start;
+        if (run->exit_reason != PROTO_EXIT_HLT) {
+            fprintf(stderr, "unexpected exit %u (hw %u) at rip 0x%llx\n",
+                    run->exit_reason, run->hw_exit_reason,
+                    (unsigned long long)run->regs.rip);
+            break;
+        }
+        if (i > 0 && memcmp(ram + FPU_OUT, pattern, sizeof(pattern))) {
+            fprintf(stderr, "guest xmm0 not preserved across run %d\n", i);
+            break;
+        }
+    }
+    munmap(run, RUN_PAGE_SIZE);
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (i < n || ioctl(fd, PROTO_GET_STATS, &stats) < 0)
+        return -1;
+    report("fpu", samples, n);
+    printf("fpu_loads_per_run=%.2f\n", (double)stats.fpu_loads / n);
+    return ioctl(fd, PROTO_DESTROY_VM);
+}
+
+static int bench_working_set(int fd, uint64_t *samples, int n)
+{
+    const uint64_t mem_size = 1ULL << 30;
+    const uint32_t pages = 4096;
+    struct proto_working_set ws = { 0 };
+    uint64_t *accessed, *dirty;
+    uint32_t page;
+    uint8_t *ram;
+    int i, ret = -1;
+
+    accessed = calloc(mem_size / 4096 / 64, sizeof(*accessed));
+    dirty = calloc(mem_size / 4096 / 64, sizeof(*dirty));
+    if (!accessed || !dirty || create_vm_size(fd, mem_size, 0, 0) < 0)
+        goto out;
+    ws.accessed = (uintptr_t)accessed;
+    ws.dirty = (uintptr_t)dirty;
+    ws.bitmap_size = mem_size / 4096 / 8;
+    ws.flags = PROTO_WS_CLEAR;
+
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        goto destroy;
+    }
+    memcpy(ram, dirty_code, sizeof(dirty_code));
+    *(uint32_t *)(ram + SNAP_COUNT) = pages;
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+
+    for (i = 0; i < n; i++) {
+        uint64_t start;
+
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            goto destroy;
+        }
+        start = now_ns();
+        if (ioctl(fd, PROTO_GET_WORKING_SET, &ws) < 0) {
+            if (errno == EOPNOTSUPP) {
+                printf("ws       skipped, no EPT accessed/dirty flags on this CPU\n");
+                ret = 0;
+            } else {
+                perror("PROTO_GET_WORKING_SET failed");
+            }
+            goto destroy;
+        }
+        samples[i] = now_ns() - start;
+        for (page = 0; page < pages; page++) {
+            uint64_t bit = SNAP_PAGES / 4096 + page;
+
+            if (!(dirty[bit / 64] & (1ULL << (bit % 64))))
+                break;
+        }
+        if (page < pages) {
+            fprintf(stderr, "working set misses page 0x%llx\n",
+                    (unsigned long long)(SNAP_PAGES + page * 4096ULL));
+            goto destroy;
+        }
+    }
+    report("ws", samples, n);
+    /* EPT leaves are 2MB here, so the sets are in whole 2MB pages */
+    printf("accessed_pages=%llu dirty_pages=%llu tables_scanned=%llu tables_skipped=%llu\n",
+           (unsigned long long)ws.accessed_pages, (unsigned long long)ws.dirty_pages,
+           (unsigned long long)ws.tables_scanned, (unsigned long long)ws.tables_skipped);
+    ret = 0;
+destroy:
+    if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+        perror("PROTO_DESTROY_VM failed");
+        ret = -1;
+    }
+out:
+    free(accessed);
+    free(dirty);
+    return ret;
+}
+
+static int set_legacy_vmcs_setup(char value)
+{
+    int fd = open(LEGACY_VMCS_SETUP, O_WRONLY);
+
+    if (fd < 0 || write(fd, &value, 1) != 1) {
+        perror(LEGACY_VMCS_SETUP);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* VMCS setup cost of n VM creations with the given setup path */
+static int vmcs_setup_cycles(int fd, uint64_t *samples, int n,
+                             struct proto_vm_stats *stats)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (create_vm(fd) < 0)
+            return -1;
+        if (ioctl(fd, PROTO_GET_STATS, stats) < 0) {
+            perror("PROTO_GET_STATS failed");
+            return -1;
+        }
+        samples[i] = stats->vmcs_setup_cycles;
+        if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+            perror("PROTO_DESTROY_VM failed");
+            return -1;
+        }
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    return 0;
+}
+
+static int bench_vmcs_setup(int fd, uint64_t *samples, int n)
+{
+    static const struct {
+        const char *name;
+        char legacy;
+    } modes[] = {
+        { "vmcs-legacy", '1' },
+        { "vmcs-template", '0' },
+    };
+    struct proto_vm_stats stats;
+    uint64_t legacy = 0;
+    unsigned int m;
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        /* without write access to the parameter only the default,
+         * template path runs */
+        if (set_legacy_vmcs_setup(modes[m].legacy) < 0 && modes[m].legacy == '1')
+            continue;
+        if (vmcs_setup_cycles(fd, samples, n, &stats) < 0) {
+            set_legacy_vmcs_setup('0');
+            return -1;
+        }
+        printf("%-8s iterations=%d min=%lucycles median=%lucycles max=%lucycles\n",
+               modes[m].name, n, samples[0], samples[n / 2], samples[n - 1]);
+        if (modes[m].legacy == '1')
+            legacy = samples[n / 2];
+    }
+    printf("vmx_nested=%u vmcs_shadowing=%u", stats.vmx_nested, stats.vmcs_shadowing);
+    if (legacy)
+        printf(" template_saves=%lldcycles",
+               (long long)(legacy - samples[n / 2]));
+    printf("\n");
+    return 0;
+}
+
+/* Set up, run and measure nvms VMs, the image mapped from image_fd or,
+ * without one, copied from image */
+static int fleet_round(int nvms, int image_fd, const uint8_t *image)
+{
+    struct proto_mem_load load = { 0 };
+    struct proto_image_map map = { .fd = image_fd, .guest_addr = FLEET_IMAGE_GPA };
+    struct proto_vm_stats stats;
+    uint64_t setup_ns = 0, run_ns = 0, resident = 0, shared = 0, cow = 0;
+    uint64_t start;
+    struct proto_run *run;
+    int fds[FLEET_MAX_VMS];
+    int i, opened = 0, ret = -1;
+
+    for (; opened < nvms; opened++) {
+        fds[opened] = open("/dev/proto", O_RDWR);
+        if (fds[opened] < 0) {
+            perror("Failed to open /dev/proto");
+            goto out;
+        }
+        if (create_vm_size(fds[opened], FLEET_IMAGE_GPA + FLEET_IMAGE_SIZE, 0, 0) < 0) {
+            close(fds[opened]);
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nvms; i++) {
+        start = now_ns();
+        load.guest_addr = 0;
+        load.size = sizeof(fleet_stub);
+        load.user_addr = (uintptr_t)fleet_stub;
+        if (ioctl(fds[i], PROTO_LOAD_MEM, &load) < 0) {
+            perror("PROTO_LOAD_MEM failed");
+            goto out;
+        }
+        if (image_fd >= 0) {
+            if (ioctl(fds[i], PROTO_MAP_SHARED_IMAGE, &map) < 0) {
+                perror("PROTO_MAP_SHARED_IMAGE failed");
+                goto out;
+            }
+        } else {
+            load.guest_addr = FLEET_IMAGE_GPA;
+            load.size = FLEET_IMAGE_SIZE;
+            load.user_addr = (uintptr_t)image;
+            if (ioctl(fds[i], PROTO_LOAD_MEM, &load) < 0) {
+                perror("PROTO_LOAD_MEM failed");
+                goto out;
+            }
+        }
+        setup_ns += now_ns() - start;
+    }
+
+    for (i = 0; i < nvms; i++) {
+        run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fds[i],
+                   PROTO_RUN_PAGE_OFFSET);
+        if (run == MAP_FAILED) {
+            perror("mmap of run page failed");
+            goto out;
+        }
+        start = now_ns();
+        if (ioctl(fds[i], PROTO_RUN) < 0 || run->exit_reason != PROTO_EXIT_HLT) {
+            fprintf(stderr, "fleet guest %d did not halt\n", i);
+            munmap(run, RUN_PAGE_SIZE);
+            goto out;
+        }
+        run_ns += now_ns() - start;
+        munmap(run, RUN_PAGE_SIZE);
+        if (ioctl(fds[i], PROTO_GET_STATS, &stats) < 0) {
+            perror("PROTO_GET_STATS failed");
+            goto out;
+        }
+        resident += stats.resident_bytes;
+        shared += stats.shared_bytes;
+        cow += stats.cow_chunks;
+    }
+    /* the shared image itself is resident once, however many VMs map it */
+    if (image_fd >= 0)
+        resident += FLEET_IMAGE_SIZE;
+    printf("%-8s vms=%d mode=%s setup_ns_per_vm=%lu run_ns_per_vm=%lu "
+           "resident_mb=%lu shared_mb=%lu cow_chunks=%lu\n",
+           "fleet", nvms, image_fd >= 0 ? "shared" : "private",
+           setup_ns / nvms, run_ns / nvms, resident >> 20, shared >> 20, cow);
+    ret = 0;
+out:
+    for (i = 0; i < opened; i++) {
+        ioctl(fds[i], PROTO_DESTROY_VM);
+        close(fds[i]);
+    }
+    return ret;
+}
+
+static int bench_fleet(int fd)
+{
+    static const int sizes[] = { 1, 16, FLEET_MAX_VMS };
+    struct proto_shared_image req = { 0 };
+    uint8_t *image;
+    unsigned int s;
+    int ret = -1;
+
+    image = calloc(1, FLEET_IMAGE_SIZE);
+    if (!image)
+        return -1;
+    memcpy(image, fleet_code, sizeof(fleet_code));
+    req.user_addr = (uintptr_t)image;
+    req.size = FLEET_IMAGE_SIZE;
+    if (ioctl(fd, PROTO_CREATE_SHARED_IMAGE, &req) < 0) {
+        if (errno == EOPNOTSUPP) {
+            printf("fleet    skipped, no 2MB EPT pages on this CPU\n");
+            ret = 0;
+        } else {
+            perror("PROTO_CREATE_SHARED_IMAGE failed");
+        }
+        free(image);
+        return ret;
+    }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (fleet_round(sizes[s], req.fd, image) < 0 ||
+            fleet_round(sizes[s], -1, image) < 0)
+            goto out;
+    }
+    ret = 0;
+out:
+    close(req.fd);
+    free(image);
+    return ret;
+}
+
+static uint8_t *map_console(int fd, const uint8_t *code, size_t size)
+{
+    struct proto_console_ring *ring;
+    uint8_t *ram;
+
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return NULL;
+    }
+    memcpy(ram, code, size);
+    ring = (struct proto_console_ring *)(ram + CONSOLE_RING);
+    ring->head = 0;
+    ring->size = CONSOLE_SIZE;
+    return ram;
+}
+
+static int bench_console(int fd, uint64_t *samples, int n)
+{
+    volatile struct proto_console_ring *ring;
+    struct proto_vm_stats stats;
+    uint32_t tail = 0, head;
+    uint64_t dropped = 0;
+    uint8_t *ram;
+    int i, ret = -1;
+
+    /* the module prints what the guest publishes in its ring */
+    if (create_vm(fd) < 0)
+        return -1;
+    ram = map_console(fd, console_check_code, sizeof(console_check_code));
+    if (!ram)
+        goto destroy;
+    memcpy(ram + CONSOLE_RING + sizeof(*ring), CONSOLE_LINE, strlen(CONSOLE_LINE));
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (ioctl(fd, PROTO_RUN) < 0 || ioctl(fd, PROTO_GET_STATS, &stats) < 0) {
+        perror("console check failed");
+        goto destroy;
+    }
+    if (stats.console_gpa != CONSOLE_RING ||
+        stats.console_bytes != strlen(CONSOLE_LINE)) {
+        fprintf(stderr, "console ring at 0x%llx printed %llu bytes, expected %zu\n",
+                (unsigned long long)stats.console_gpa,
+                (unsigned long long)stats.console_bytes, strlen(CONSOLE_LINE));
+        goto destroy;
+    }
+    if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+        perror("PROTO_DESTROY_VM failed");
+        return -1;
+    }
+
+    /* this process is the reader */
+    if (create_vm_config(fd, PROTO_VM_USER_CONSOLE, 0) < 0)
+        return -1;
+    ram = map_console(fd, console_code, sizeof(console_code));
+    if (!ram)
+        goto destroy;
+    ring = (volatile struct proto_console_ring *)(ram + CONSOLE_RING);
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            goto unmap;
+        }
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - tail > CONSOLE_SIZE) {
+            dropped += head - tail - CONSOLE_SIZE;
+            tail = head - CONSOLE_SIZE;
+        }
+        for (; tail != head; tail += 8) {
+            uint64_t record = *(volatile uint64_t *)(ram + CONSOLE_RING +
+                                                     sizeof(*ring) + tail % CONSOLE_SIZE);
+
+            if (record != tail) {
+                fprintf(stderr, "console record at %u reads %llu\n", tail,
+                        (unsigned long long)record);
+                goto unmap;
+            }
+        }
+        samples[i] = now_ns() - start;
+    }
+    report("console", samples, n);
+    printf("records_per_run=%d bytes=%u dropped=%llu\n", CONSOLE_RECORDS, tail,
+           (unsigned long long)dropped);
+    ret = 0;
+unmap:
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+destroy:
+    if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+        perror("PROTO_DESTROY_VM failed");
+        ret = -1;
+    }
+    return ret;
+}
+
+/* How late each of n 1ms sleeps ends, next to a spinning guest */
+static int latency_sleeper(uint64_t *samples, int n)
+{
+    struct timespec ts = { 0, LATENCY_SLEEP_NS };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+
+        nanosleep(&ts, NULL);
+        samples[i] = now_ns() - start - LATENCY_SLEEP_NS;
+    }
+    report("latency", samples, n);
+    return 0;
+}
+
+static void on_alarm(int sig)
+{
+    (void)sig;
+}
+
+static int bench_latency(int fd, uint64_t *samples, int n)
+{
+    struct itimerval alarm_in = { .it_value = { 0, LATENCY_ALARM_US } };
+    struct sigaction sa = { .sa_handler = on_alarm };
+    struct proto_run *run;
+    cpu_set_t set, saved;
+    uint64_t start;
+    uint8_t *ram;
+    pid_t pid;
+    int status, ret = -1;
+
+    if (n > LATENCY_WAKEUPS)
+        n = LATENCY_WAKEUPS;
+    /* the sleeper inherits the CPU, so it competes with the guest */
+    if (sched_getaffinity(0, sizeof(saved), &saved) < 0)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity failed");
+        return -1;
+    }
+    if (create_vm_config(fd, 0, LATENCY_SLICE_US) < 0)
+        goto restore;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        goto restore;
+    }
+    memcpy(ram, spin_code, sizeof(spin_code));
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+               PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        goto unmap_ram;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        goto unmap_run;
+    }
+    if (pid == 0)
+        _exit(latency_sleeper(samples, n) ? 1 : 0);
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            goto unmap_run;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        goto unmap_run;
+
+    /* without SA_RESTART, as a caller that wants to stop the guest would */
+    if (sigaction(SIGALRM, &sa, NULL) < 0 ||
+        setitimer(ITIMER_REAL, &alarm_in, NULL) < 0) {
+        perror("SIGALRM setup failed");
+        goto unmap_run;
+    }
+    start = now_ns();
+    if (ioctl(fd, PROTO_RUN) < 0) {
+        perror("PROTO_RUN failed");
+        goto unmap_run;
+    }
+    printf("signal   alarm=%dus run=%luns\n", LATENCY_ALARM_US,
+           now_ns() - start);
+    if (run->exit_reason != PROTO_EXIT_PREEMPTED) {
+        fprintf(stderr, "spinning guest exited with %u (hw %u)\n",
+                run->exit_reason, run->hw_exit_reason);
+        goto unmap_run;
+    }
+    ret = 0;
+
+unmap_run:
+    munmap(run, RUN_PAGE_SIZE);
+unmap_ram:
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    /* only once nothing of the VM is mapped any more */
+    if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+        perror("PROTO_DESTROY_VM failed");
+        ret = -1;
+    }
+restore:
+    sched_setaffinity(0, sizeof(saved), &saved);
+    return ret;
+}
+
+/* One scaling worker: a private vCPU pinned to cpu, n warm runs once the
+ * parent releases the start barrier. The elapsed time goes to *elapsed. */
+static int scale_worker(int cpu, int n, int start_fd, uint64_t *elapsed)
+{
+    cpu_set_t set;
+    uint8_t *ram;
+    uint64_t start;
+    char go;
+    int fd, i;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity failed");
+        return -1;
+    }
+    fd = open("/dev/proto", O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open /dev/proto");
+        return -1;
+    }
+    if (create_vm(fd) < 0)
+        return -1;
+    ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return -1;
+    }
+    memcpy(ram, guest_code, sizeof(guest_code));
+
+    /* the parent closes its end of the pipe to start everyone at once */
+    if (read(start_fd, &go, 1) < 0)
+        return -1;
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            return -1;
+        }
+    }
+    *elapsed = now_ns() - start;
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    close(fd);
+    return 0;
+}
+
+static int bench_scale(int n, int max_procs)
+{
+    uint64_t *elapsed;
+    int procs, i, ret = 0;
+
+    /* shared with the children so they can hand back their timings */
+    elapsed = mmap(NULL, max_procs * sizeof(*elapsed), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (elapsed == MAP_FAILED) {
+        perror("mmap of result area failed");
+        return -1;
+    }
+
+    for (procs = 1; procs <= max_procs && !ret; procs++) {
+        uint64_t slowest = 0;
+        int start_pipe[2];
+
+        if (pipe(start_pipe) < 0) {
+            perror("pipe failed");
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < procs; i++) {
+            pid_t pid = fork();
+
+            if (pid < 0) {
+                perror("fork failed");
+                ret = -1;
+                break;
+            }
+            if (pid == 0) {
+                close(start_pipe[1]);
+                _exit(scale_worker(i, n, start_pipe[0], &elapsed[i]) ? 1 : 0);
+            }
+        }
+        close(start_pipe[0]);
+        close(start_pipe[1]);
+
+        while (i-- > 0) {
+            int status;
+
+            if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+                ret = -1;
+        }
+        if (ret)
+            break;
+        for (i = 0; i < procs; i++)
+            if (elapsed[i] > slowest)
+                slowest = elapsed[i];
+        printf("scale    vcpus=%d runs=%d runs_per_sec=%.0f per_vcpu=%.0f\n",
+               procs, procs * n, procs * n * 1e9 / slowest,
+               n * 1e9 / slowest);
+    }
+    munmap(elapsed, max_procs * sizeof(*elapsed));
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    int max_procs = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct proto_exit_stats exits;
+    uint64_t *samples;
+    int fd, ret = 0;
+
+    if (n <= 0 || max_procs <= 0) {
+        fprintf(stderr, "usage: %s [iterations [max_vcpus]]\n", argv[0]);
+        return 1;
+    }
+
+    fd = open("/dev/proto", O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open /dev/proto");
+        return 1;
+    }
+
+    samples = calloc(n, sizeof(*samples));
+    if (!samples) {
+        close(fd);
+        return 1;
+    }
+
+    if (bench_cold(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("cold", samples, n);
+
+    if (ioctl(fd, PROTO_GET_EXIT_STATS, &exits) < 0) {
+        perror("PROTO_GET_EXIT_STATS failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if (bench_warm(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("warm", samples, n);
+    report_exits(fd, &exits);
+
+    if (bench_hypercalls(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_vpid(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_slice(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_snapshot(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_dirty_log(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_fpu(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_working_set(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_vmcs_setup(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_fleet(fd) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_console(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_latency(fd, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (bench_scale(n, max_procs) < 0)
+        ret = 1;
+
+cleanup:
+    free(samples);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,461 @@
+/*
+ * Proto Exit Benchmark
+ *
+ * Cycles per round trip through the hypervisor, one exit type at a time:
+ * 1. "vmcall": a no-op hypercall, handled in the kernel
+ * 2. "cpuid": CPUID leaf 0, emulated in the kernel
+ * 3. "ept": the first write to an unbacked 2MB region, a demand fault
+ *    that allocates and maps the region in the kernel
+ * 4. "hlt": a guest that halts right away, i.e. a whole PROTO_RUN
+ * 5. "io": a guest doing OUT to port 0x80, i.e. a whole PROTO_RUN
+ *
+ * The in-kernel exits are timed by the guest itself: it reads the TSC
+ * around the exiting instruction in a tight loop and stores every delta
+ * in guest memory. HLT and I/O exits end the run, so they are timed by
+ * the caller around PROTO_RUN. RDTSC does not exit in either case, which
+ * keeps the numbers comparable between bare metal and a nested L1 guest.
+ *
+ * Results are TSC cycles, one line per exit type, as CSV or JSON.
+ *
+ * With --compare, only "vmcall" and "cpuid" are measured, once through the
+ * module's old C exit path and once through its assembly entry stub
+ * (the legacy_exit_path module parameter), and the median cycles the stub
+ * saves per exit go to stderr.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <x86intrin.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "proto-src/proto_ioctl.h"
+
+#define DEFAULT_SAMPLES 10000
+#define LEGACY_EXIT_PATH "/sys/module/proto/parameters/legacy_exit_path"
+#define RUN_PAGE_SIZE 4096
+/* the longest time slice the module takes, so a sample is rarely cut */
+#define TIME_SLICE_US 60000000
+
+/* Guest memory used by the timed loop: the sample count and loop state at
+ * GUEST_VARS, one 8-byte delta per sample from GUEST_RESULTS up to the end
+ * of the first 2MB, which is always backed and mapped here. */
+#define GUEST_VARS 0x20000
+#define GUEST_RESULTS 0x100000
+#define MAX_SAMPLES ((PROTO_DEFAULT_MEM_SIZE - GUEST_RESULTS) / 8)
+
+/* The timed loop, split around the exiting instruction. Nothing is kept in
+ * registers across the exit: the count is at [GUEST_VARS], the start TSC
+ * at [GUEST_VARS+8] and the sample index at [GUEST_VARS+0x10]. */
+static const uint8_t loop_head[] = {
+    0x48, 0xc7, 0x04, 0x25, 0x10, 0x00, 0x02, 0x00,   /* mov qword [0x20010], 0 */
+    0x00, 0x00, 0x00, 0x00,
+    0x48, 0x8b, 0x0c, 0x25, 0x10, 0x00, 0x02, 0x00,   /* 1: mov rcx, [0x20010] */
+    0x48, 0x3b, 0x0c, 0x25, 0x00, 0x00, 0x02, 0x00,   /* cmp rcx, [0x20000] */
+    0x73, 0x00,                                       /* jae 2f */
+    0x0f, 0xae, 0xe8,                                 /* lfence */
+    0x0f, 0x31,                                       /* rdtsc */
+    0x48, 0xc1, 0xe2, 0x20,                           /* shl rdx, 32 */
+    0x48, 0x09, 0xd0,                                 /* or rax, rdx */
+    0x48, 0x89, 0x04, 0x25, 0x08, 0x00, 0x02, 0x00,   /* mov [0x20008], rax */
+};
+#define LOOP_START 12   /* offset of 1: */
+#define LOOP_JAE 29     /* offset of the jae displacement */
+
+static const uint8_t loop_tail[] = {
+    0x0f, 0xae, 0xe8,                                 /* lfence */
+    0x0f, 0x31,                                       /* rdtsc */
+    0x48, 0xc1, 0xe2, 0x20,                           /* shl rdx, 32 */
+    0x48, 0x09, 0xd0,                                 /* or rax, rdx */
+    0x48, 0x2b, 0x04, 0x25, 0x08, 0x00, 0x02, 0x00,   /* sub rax, [0x20008] */
+    0x48, 0x8b, 0x0c, 0x25, 0x10, 0x00, 0x02, 0x00,   /* mov rcx, [0x20010] */
+    0x48, 0x89, 0x04, 0xcd, 0x00, 0x00, 0x10, 0x00,   /* mov [0x100000+rcx*8], rax */
+    0x48, 0xff, 0xc1,                                 /* inc rcx */
+    0x48, 0x89, 0x0c, 0x25, 0x10, 0x00, 0x02, 0x00,   /* mov [0x20010], rcx */
+    0xeb, 0x00,                                       /* jmp 1b */
+    0xf4,                                             /* 2: hlt */
+};
+
+/* xor eax, eax (PROTO_HC_NOP); vmcall */
+static const uint8_t vmcall_insn[] = {
+    0x31, 0xc0,
+    0x0f, 0x01, 0xc1,
+};
+
+/* xor eax, eax; xor ecx, ecx; cpuid */
+static const uint8_t cpuid_insn[] = {
+    0x31, 0xc0,
+    0x31, 0xc9,
+    0x0f, 0xa2,
+};
+
+/* mov byte [(index + 1) << 21], 1: a new 2MB region every iteration */
+static const uint8_t ept_insn[] = {
+    0x48, 0x8b, 0x0c, 0x25, 0x10, 0x00, 0x02, 0x00,   /* mov rcx, [0x20010] */
+    0x48, 0xff, 0xc1,                                 /* inc rcx */
+    0x48, 0xc1, 0xe1, 0x15,                           /* shl rcx, 21 */
+    0xc6, 0x01, 0x01,                                 /* mov byte [rcx], 1 */
+};
+
+/* Regions faulted per VM. Every sample needs fresh memory, so the ept
+ * pass recreates the VM until it has enough of them. */
+#define EPT_PER_VM 64
+#define EPT_MEM_SIZE ((EPT_PER_VM + 1) * PROTO_DEFAULT_MEM_SIZE)
+
+/* hlt */
+static const uint8_t hlt_code[] = { 0xf4 };
+
+/* 1: out 0x80, al; jmp 1b (each run continues after the OUT) */
+static const uint8_t io_code[] = { 0xe6, 0x80, 0xeb, 0xfc };
+
+static uint64_t rdtsc_ordered(void)
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, uint64_t *samples, int n, int json,
+                   int first)
+{
+    uint64_t p99;
+
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    p99 = samples[(int)((n - 1) * 0.99)];
+    if (json)
+        printf("%s  {\"exit\": \"%s\", \"samples\": %d, \"min_cycles\": %lu, "
+               "\"median_cycles\": %lu, \"p99_cycles\": %lu, "
+               "\"max_cycles\": %lu}",
+               first ? "" : ",\n", name, n, samples[0], samples[n / 2], p99,
+               samples[n - 1]);
+    else
+        printf("%s,%d,%lu,%lu,%lu,%lu\n", name, n, samples[0], samples[n / 2],
+               p99, samples[n - 1]);
+}
+
+/* Build the timed loop around insn at the start of guest RAM */
+static void write_timed_loop(uint8_t *ram, const uint8_t *insn, size_t len)
+{
+    size_t tail = sizeof(loop_head) + len;
+    size_t end = tail + sizeof(loop_tail);
+
+    memcpy(ram, loop_head, sizeof(loop_head));
+    memcpy(ram + sizeof(loop_head), insn, len);
+    memcpy(ram + tail, loop_tail, sizeof(loop_tail));
+    /* jae to the hlt, jmp back to the loop head; both are rel8 */
+    ram[LOOP_JAE] = end - 1 - (LOOP_JAE + 1);
+    ram[end - 2] = (uint8_t)(LOOP_START - (end - 1));
+}
+
+static int create_vm(int fd, uint64_t mem_size)
+{
+    struct proto_vm_config config = {
+        .mem_size = mem_size,
+        .time_slice_us = TIME_SLICE_US,
+    };
+
+    if (ioctl(fd, PROTO_CREATE_VM, &config) < 0) {
+        perror("PROTO_CREATE_VM failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int destroy_vm(int fd)
+{
+    if (ioctl(fd, PROTO_DESTROY_VM) < 0) {
+        perror("PROTO_DESTROY_VM failed");
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t *map_ram(int fd)
+{
+    uint8_t *ram = mmap(NULL, PROTO_DEFAULT_MEM_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+
+    if (ram == MAP_FAILED) {
+        perror("mmap of guest RAM failed");
+        return NULL;
+    }
+    return ram;
+}
+
+/* One run of the timed loop for n samples, which must end in HLT; a
+ * preempted run goes on where it stopped */
+static int run_timed_loop(int fd, struct proto_run *run, uint8_t *ram,
+                          uint64_t *samples, int n)
+{
+    *(uint64_t *)(ram + GUEST_VARS) = n;
+    do {
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            return -1;
+        }
+    } while (run->exit_reason == PROTO_EXIT_PREEMPTED);
+    if (run->exit_reason != PROTO_EXIT_HLT) {
+        fprintf(stderr, "unexpected exit %u (hw %u) at rip 0x%llx\n",
+                run->exit_reason, run->hw_exit_reason,
+                (unsigned long long)run->regs.rip);
+        return -1;
+    }
+    memcpy(samples, ram + GUEST_RESULTS, n * sizeof(*samples));
+    return 0;
+}
+
+/* vmcall and cpuid: one VM, a warm-up run, then the measured run */
+static int bench_in_kernel(int fd, struct proto_run *run, const uint8_t *insn,
+                           size_t len, uint64_t *samples, int n)
+{
+    uint8_t *ram;
+    int ret;
+
+    if (create_vm(fd, 0) < 0)
+        return -1;
+    ram = map_ram(fd);
+    if (!ram)
+        return -1;
+    write_timed_loop(ram, insn, len);
+    ret = run_timed_loop(fd, run, ram, samples, n);
+    if (!ret)
+        ret = run_timed_loop(fd, run, ram, samples, n);
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (destroy_vm(fd) < 0)
+        return -1;
+    return ret;
+}
+
+static int bench_ept(int fd, struct proto_run *run, uint64_t *samples, int n)
+{
+    uint8_t *ram;
+    int done;
+
+    for (done = 0; done < n; done += EPT_PER_VM) {
+        int batch = n - done < EPT_PER_VM ? n - done : EPT_PER_VM;
+        int ret;
+
+        if (create_vm(fd, EPT_MEM_SIZE) < 0)
+            return -1;
+        ram = map_ram(fd);
+        if (!ram)
+            return -1;
+        write_timed_loop(ram, ept_insn, sizeof(ept_insn));
+        ret = run_timed_loop(fd, run, ram, samples + done, batch);
+        munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+        if (destroy_vm(fd) < 0 || ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* hlt and io: the exit goes to userspace, so time the whole PROTO_RUN */
+static int bench_to_user(int fd, struct proto_run *run, const uint8_t *code,
+                         size_t len, uint32_t exit_reason, uint64_t *samples,
+                         int n)
+{
+    struct proto_intercept io = {
+        .kind = PROTO_INTERCEPT_IO,
+        .first = 0x80,
+        .count = 1,
+        .trap = 1,
+    };
+    uint8_t *ram;
+    int i;
+
+    if (create_vm(fd, 0) < 0)
+        return -1;
+    if (ioctl(fd, PROTO_SET_INTERCEPT, &io) < 0) {
+        perror("PROTO_SET_INTERCEPT failed");
+        return -1;
+    }
+    ram = map_ram(fd);
+    if (!ram)
+        return -1;
+    memcpy(ram, code, len);
+
+    /* the first run is a warm-up */
+    for (i = -1; i < n; i++) {
+        uint64_t start = rdtsc_ordered();
+
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            break;
+        }
+        if (i >= 0)
+            samples[i] = rdtsc_ordered() - start;
+        if (run->exit_reason != exit_reason) {
+            fprintf(stderr, "unexpected exit %u (hw %u) at rip 0x%llx\n",
+                    run->exit_reason, run->hw_exit_reason,
+                    (unsigned long long)run->regs.rip);
+            break;
+        }
+    }
+    munmap(ram, PROTO_DEFAULT_MEM_SIZE);
+    if (destroy_vm(fd) < 0 || i < n)
+        return -1;
+    return 0;
+}
+
+static int set_legacy_exit_path(char value)
+{
+    int fd = open(LEGACY_EXIT_PATH, O_WRONLY);
+
+    if (fd < 0 || write(fd, &value, 1) != 1) {
+        perror(LEGACY_EXIT_PATH);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* vmcall and cpuid through both exit paths, legacy first */
+static int compare_exit_paths(int fd, struct proto_run *run, uint64_t *samples,
+                              int n, int json)
+{
+    static const struct {
+        const char *name;
+        const uint8_t *insn;
+        size_t len;
+    } exits[] = {
+        { "vmcall", vmcall_insn, sizeof(vmcall_insn) },
+        { "cpuid", cpuid_insn, sizeof(cpuid_insn) },
+    };
+    uint64_t legacy;
+    char name[32];
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < sizeof(exits) / sizeof(exits[0]) && !ret; i++) {
+        if (set_legacy_exit_path('1') < 0 ||
+            bench_in_kernel(fd, run, exits[i].insn, exits[i].len, samples, n) < 0) {
+            ret = -1;
+            break;
+        }
+        snprintf(name, sizeof(name), "%s-legacy", exits[i].name);
+        report(name, samples, n, json, i == 0);
+        legacy = samples[n / 2];
+
+        if (set_legacy_exit_path('0') < 0 ||
+            bench_in_kernel(fd, run, exits[i].insn, exits[i].len, samples, n) < 0) {
+            ret = -1;
+            break;
+        }
+        snprintf(name, sizeof(name), "%s-stub", exits[i].name);
+        report(name, samples, n, json, 0);
+        fprintf(stderr, "%s: the entry stub saves %lld cycles per exit (median)\n",
+                exits[i].name, (long long)(legacy - samples[n / 2]));
+    }
+    set_legacy_exit_path('0');
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    struct proto_run *run;
+    uint64_t *samples;
+    int json = 0, compare = 0, n = DEFAULT_SAMPLES;
+    int fd, ret = 0;
+
+    for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[1], "--json"))
+            json = 1;
+        else if (!strcmp(argv[1], "--compare"))
+            compare = 1;
+        else
+            n = 0;
+    }
+    if (argc > 1)
+        n = atoi(argv[1]);
+    if (n <= 0 || (uint64_t)n > MAX_SAMPLES) {
+        fprintf(stderr, "usage: proto_exit_bench [--json] [--compare] [samples (1..%llu)]\n",
+                (unsigned long long)MAX_SAMPLES);
+        return 1;
+    }
+
+    fd = open("/dev/proto", O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open /dev/proto");
+        return 1;
+    }
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+               PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        close(fd);
+        return 1;
+    }
+    samples = calloc(n, sizeof(*samples));
+    if (!samples) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (json)
+        printf("[\n");
+    else
+        printf("exit,samples,min_cycles,median_cycles,p99_cycles,max_cycles\n");
+
+    if (compare) {
+        if (compare_exit_paths(fd, run, samples, n, json) < 0)
+            ret = 1;
+        else if (json)
+            printf("\n]\n");
+        goto cleanup;
+    }
+
+    if (bench_in_kernel(fd, run, vmcall_insn, sizeof(vmcall_insn), samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("vmcall", samples, n, json, 1);
+
+    if (bench_in_kernel(fd, run, cpuid_insn, sizeof(cpuid_insn), samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("cpuid", samples, n, json, 0);
+
+    if (bench_to_user(fd, run, hlt_code, sizeof(hlt_code), PROTO_EXIT_HLT,
+                      samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("hlt", samples, n, json, 0);
+
+    if (bench_ept(fd, run, samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("ept", samples, n, json, 0);
+
+    if (bench_to_user(fd, run, io_code, sizeof(io_code), PROTO_EXIT_IO,
+                      samples, n) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    report("io", samples, n, json, 0);
+
+    if (json)
+        printf("\n]\n");
+
+cleanup:
+    free(samples);
+    munmap(run, RUN_PAGE_SIZE);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,168 @@
+/*
+ * Proto Image Loader
+ *
+ * Runs a guest payload from a file under /dev/proto: an ELF64 executable,
+ * whose PT_LOAD segments go to their physical addresses and whose entry
+ * point becomes RIP, or a flat binary loaded at -a and entered at -e.
+ * The file is mapped, not read, so the module copies each segment straight
+ * from the page cache into guest RAM.
+ *
+ * The guest runs until it exits for anything but the end of its time
+ * slice, and the exit is printed with the guest registers. A guest ends
+ * normally with HLT, so this is a quick way to run a mini kernel or a
+ * benchmark kernel and look at what it left in RAX.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "proto-src/proto_ioctl.h"
+
+#define RUN_PAGE_SIZE 4096
+
+static const char *const exit_names[] = {
+    [PROTO_EXIT_UNKNOWN] = "unknown",
+    [PROTO_EXIT_HLT] = "hlt",
+    [PROTO_EXIT_IO] = "io",
+    [PROTO_EXIT_MMIO] = "mmio",
+    [PROTO_EXIT_SHUTDOWN] = "shutdown",
+    [PROTO_EXIT_FAIL_ENTRY] = "fail-entry",
+    [PROTO_EXIT_INTERNAL] = "internal",
+    [PROTO_EXIT_MSR] = "msr",
+    [PROTO_EXIT_PREEMPTED] = "preempted",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: proto_load [-m mem_mb] [-a load_addr] [-e entry] [-s stack] image\n"
+            "  ELF images are detected; anything else is flat and loaded at -a\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct proto_vm_config config = { 0 };
+    struct proto_image_load image = { 0 };
+    const struct proto_regs *r;
+    struct proto_run *run;
+    struct stat st;
+    uint64_t start, load_ns, runs = 0;
+    void *file;
+    int fd, img, opt, ret = 1;
+
+    while ((opt = getopt(argc, argv, "m:a:e:s:")) != -1) {
+        switch (opt) {
+        case 'm':
+            config.mem_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'a':
+            image.load_addr = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            image.entry = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            image.stack = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    img = open(argv[optind], O_RDONLY);
+    if (img < 0 || fstat(img, &st) < 0 || st.st_size == 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img, 0);
+    close(img);
+    if (file == MAP_FAILED) {
+        perror("mmap of image failed");
+        return 1;
+    }
+    image.user_addr = (uintptr_t)file;
+    image.size = st.st_size;
+    image.format = st.st_size >= 4 && !memcmp(file, "\x7f" "ELF", 4) ?
+                   PROTO_IMAGE_ELF : PROTO_IMAGE_FLAT;
+
+    fd = open("/dev/proto", O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open /dev/proto");
+        goto unmap_file;
+    }
+    if (ioctl(fd, PROTO_CREATE_VM, &config) < 0) {
+        perror("PROTO_CREATE_VM failed");
+        goto close_fd;
+    }
+    run = mmap(NULL, RUN_PAGE_SIZE, PROT_READ, MAP_SHARED, fd,
+               PROTO_RUN_PAGE_OFFSET);
+    if (run == MAP_FAILED) {
+        perror("mmap of run page failed");
+        goto destroy;
+    }
+
+    start = now_ns();
+    if (ioctl(fd, PROTO_LOAD_IMAGE, &image) < 0) {
+        perror("PROTO_LOAD_IMAGE failed");
+        goto unmap_run;
+    }
+    load_ns = now_ns() - start;
+    printf("load     format=%s size=%llu entry=0x%llx stack=0x%llx ns=%llu\n",
+           image.format == PROTO_IMAGE_ELF ? "elf" : "flat",
+           (unsigned long long)image.size, (unsigned long long)image.entry,
+           (unsigned long long)image.stack, (unsigned long long)load_ns);
+
+    start = now_ns();
+    do {
+        if (ioctl(fd, PROTO_RUN) < 0) {
+            perror("PROTO_RUN failed");
+            goto unmap_run;
+        }
+        runs++;
+    } while (run->exit_reason == PROTO_EXIT_PREEMPTED);
+
+    r = &run->regs;
+    printf("exit     reason=%s hw=%u runs=%llu ns=%llu\n",
+           run->exit_reason < sizeof(exit_names) / sizeof(exit_names[0]) ?
+           exit_names[run->exit_reason] : "?", run->hw_exit_reason,
+           (unsigned long long)runs, (unsigned long long)(now_ns() - start));
+    printf("regs     rip=0x%llx rsp=0x%llx rflags=0x%llx\n",
+           (unsigned long long)r->rip, (unsigned long long)r->rsp,
+           (unsigned long long)r->rflags);
+    printf("regs     rax=0x%llx rbx=0x%llx rcx=0x%llx rdx=0x%llx\n",
+           (unsigned long long)r->rax, (unsigned long long)r->rbx,
+           (unsigned long long)r->rcx, (unsigned long long)r->rdx);
+    ret = run->exit_reason == PROTO_EXIT_HLT ? 0 : 2;
+
+unmap_run:
+    munmap(run, RUN_PAGE_SIZE);
+destroy:
+    ioctl(fd, PROTO_DESTROY_VM);
+close_fd:
+    close(fd);
+unmap_file:
+    munmap(file, st.st_size);
+    return ret;
+}
@@ -0,0 +1,432 @@
+/*
+ * Proto Paging Benchmark
+ *
+ * Builds the tables proto.ko builds, with the same code (proto-src/paging.c),
+ * but in userspace, so no VMX hardware or module is needed:
+ * 1. "guest-1g"/"guest-2m": the guest's identity map of all its RAM, with
+ *    and without 1GB guest pages
+ * 2. "ept-1g"/"ept-2m"/"ept-4k": the EPT for all of guest RAM in one call,
+ *    with the leaf sizes the CPU may or may not support
+ * 3. "ept-chunk": the EPT built 2MB at a time, the way demand faults do
+ * 4. "ept-scan": ept_scan_ad() over a 4K-leaf EPT in which 64 pages were
+ *    touched, half of them written, the way the CPU would have set the
+ *    accessed and dirty flags
+ *
+ * Every table is walked in full by a page walker of its own: each address
+ * must map to itself (the EPT to itself plus an offset standing in for host
+ * memory) through the largest page that fits, nothing past the end may
+ * map, and every entry must allow supervisor reads, writes and execution
+ * (guest entries with U/S clear, for SMEP and SMAP).
+ * Then the construction is timed for guest sizes from 1MB to 64GB. The
+ * scan must report exactly the touched pages, skip the tables nobody
+ * touched, and find nothing left after clearing.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "proto-src/paging.h"
+
+#define MIN_SIZE (1ULL << 20)
+#define MAX_SIZE (64ULL << 30)
+/* repeat each build until this much time has passed */
+#define MIN_BENCH_NS 20000000ull
+/* host physical base of the pretend EPT target, 1GB aligned */
+#define HPA_OFFSET (1ULL << 40)
+/* pages touched per size for ept-scan, spread evenly */
+#define SCAN_TOUCHES 64
+
+static uint64_t tables_allocated;
+
+static void *user_alloc_table(void)
+{
+    void *table = aligned_alloc(4096, 4096);
+
+    if (table) {
+        memset(table, 0, 4096);
+        tables_allocated++;
+    }
+    return table;
+}
+
+static void user_free_table(void *table)
+{
+    free(table);
+}
+
+/* userspace tables are "physical" at their virtual address */
+static uint64_t user_table_pa(void *table)
+{
+    return (uintptr_t)table;
+}
+
+static void *user_table_va(uint64_t pa)
+{
+    return (void *)(uintptr_t)pa;
+}
+
+static const struct paging_ops user_ops = {
+    .alloc_table = user_alloc_table,
+    .free_table = user_free_table,
+    .table_pa = user_table_pa,
+    .table_va = user_table_va,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The page the builders should have used at addr: the largest one up to
+ * max_page that is aligned there and still ends inside size bytes */
+static uint64_t expected_page(uint64_t addr, uint64_t size, uint64_t max_page)
+{
+    uint64_t page;
+
+    for (page = max_page; page > EPT_PAGE_SIZE_4K; page >>= 9)
+        if ((addr & ~(page - 1)) + page <= size)
+            break;
+    return page;
+}
+
+/* The walker the tables are checked with is written against the SDM, not
+ * paging.c: entries are raw 64-bit words and every leaf is visited, so a
+ * builder bug cannot hide behind a matching bug in its own walker. */
+#define ENTRY_ADDR(e) ((e) & 0x000ffffffffff000ull)
+#define GUEST_PRESENT (1ull << 0)  /* CH 4.5, Vol 3 */
+#define GUEST_RW (1ull << 1)
+#define GUEST_US (1ull << 2)
+#define GUEST_XD (1ull << 63)
+#define EPT_READ (1ull << 0)       /* CH 29.3.2, Vol 3 */
+#define EPT_RWX 7ull
+#define ENTRY_PS (1ull << 7)       /* large page in a PDPTE or PDE, both formats */
+
+struct walk {
+    const char *name;
+    const uint8_t *ram;  /* guest tables are at GPAs in ram; EPT: NULL */
+    uint64_t size;       /* bytes that must be mapped, from 0 */
+    uint64_t max_page;   /* largest leaf the builder may use */
+    uint64_t offset;     /* each address must map to itself plus this */
+    uint64_t mapped;     /* out: bytes under all leaves */
+};
+
+static const uint64_t *walk_table(const struct walk *w, uint64_t pa)
+{
+    if (!w->ram)
+        return (const uint64_t *)(uintptr_t)pa;
+    if (pa < GUEST_PAGE_TABLES || pa >= GUEST_PAGE_TABLES_END)
+        return NULL;
+    return (const uint64_t *)(w->ram + pa);
+}
+
+/* Check every leaf under table, which maps 512 << shift bytes from base */
+static int walk_level(struct walk *w, const uint64_t *table, int shift,
+                      uint64_t base)
+{
+    uint64_t present = w->ram ? GUEST_PRESENT : EPT_READ;
+    uint64_t page = 1ull << shift;
+    int i;
+
+    for (i = 0; i < 512; i++) {
+        uint64_t e = table[i], addr = base + i * page;
+        const uint64_t *next;
+
+        if (!(e & present))
+            continue;
+        /* every level: the guest runs at CPL0 under SMEP/SMAP and writes
+         * and executes anywhere in its RAM */
+        if (w->ram ? (e & (GUEST_RW | GUEST_US | GUEST_XD)) != GUEST_RW :
+                     (e & EPT_RWX) != EPT_RWX) {
+            fprintf(stderr, "%s: entry 0x%llx for 0x%llx has the wrong permissions\n",
+                    w->name, (unsigned long long)e, (unsigned long long)addr);
+            return -1;
+        }
+        /* PS is reserved in a PML4 entry and means PAT in a 4K one */
+        if (shift == 12 || (shift < 39 && (e & ENTRY_PS))) {
+            if (addr >= w->size || page != expected_page(addr, w->size, w->max_page) ||
+                (ENTRY_ADDR(e) & ~(page - 1)) != addr + w->offset) {
+                fprintf(stderr, "%s: 0x%llx maps to 0x%llx with a 0x%llx page\n",
+                        w->name, (unsigned long long)addr,
+                        (unsigned long long)(ENTRY_ADDR(e) & ~(page - 1)),
+                        (unsigned long long)page);
+                return -1;
+            }
+            w->mapped += page;
+            continue;
+        }
+        next = walk_table(w, ENTRY_ADDR(e));
+        if (!next) {
+            fprintf(stderr, "%s: table for 0x%llx outside the table area\n",
+                    w->name, (unsigned long long)addr);
+            return -1;
+        }
+        if (walk_level(w, next, shift - 9, addr) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Leaves are disjoint and each lies below size, so mapping size bytes in
+ * total means every address is mapped exactly once */
+static int walk_check(struct walk *w, const uint64_t *root)
+{
+    w->mapped = 0;
+    if (walk_level(w, root, 39, 0) < 0)
+        return -1;
+    if (w->mapped != w->size) {
+        fprintf(stderr, "%s: 0x%llx of 0x%llx bytes mapped\n", w->name,
+                (unsigned long long)w->mapped, (unsigned long long)w->size);
+        return -1;
+    }
+    return 0;
+}
+
+static int check_guest(const uint8_t *ram, uint64_t size, int gbpages)
+{
+    struct walk w = {
+        .name = "guest",
+        .ram = ram,
+        .size = size,
+        .max_page = gbpages ? EPT_PAGE_SIZE_1GB : EPT_PAGE_SIZE_2MB,
+    };
+
+    return walk_check(&w, walk_table(&w, GUEST_PAGE_TABLES));
+}
+
+static int check_ept(EPT_PML4_ENTRY *pml4, uint64_t size, uint64_t max_page)
+{
+    struct walk w = {
+        .name = "ept",
+        .size = size,
+        .max_page = max_page,
+        .offset = HPA_OFFSET,
+    };
+
+    return walk_check(&w, (const uint64_t *)pml4);
+}
+
+static void report(const char *name, uint64_t size, uint64_t tables,
+                   uint64_t min, uint64_t total, int reps)
+{
+    printf("%-9s size=%lluM tables=%llu reps=%d min=%lluns mean=%lluns\n",
+           name, (unsigned long long)(size >> 20), (unsigned long long)tables,
+           reps, (unsigned long long)min, (unsigned long long)(total / reps));
+}
+
+static int bench_guest(const char *name, uint8_t *ram, uint64_t size,
+                       int gbpages)
+{
+    uint64_t min = UINT64_MAX, total = 0, t;
+    int reps = 0;
+
+    if (GUEST_PAGE_TABLES + guest_page_tables_size(size, gbpages) > GUEST_PAGE_TABLES_END) {
+        printf("%-9s size=%lluM does not fit below 0x%x\n", name,
+               (unsigned long long)(size >> 20), GUEST_PAGE_TABLES_END);
+        return 0;
+    }
+    do {
+        /* the module builds into freshly zeroed guest memory */
+        memset(ram, 0, GUEST_PAGE_TABLES_END);
+        t = now_ns();
+        if (!guest_build_page_tables(ram, size, gbpages)) {
+            fprintf(stderr, "%s: building tables for 0x%llx bytes failed\n",
+                    name, (unsigned long long)size);
+            return -1;
+        }
+        t = now_ns() - t;
+        if (t < min)
+            min = t;
+        total += t;
+        reps++;
+    } while (total < MIN_BENCH_NS);
+
+    if (check_guest(ram, size, gbpages) < 0)
+        return -1;
+    report(name, size, guest_page_tables_size(size, gbpages) / 4096, min,
+           total, reps);
+    return 0;
+}
+
+static int bench_ept(const char *name, uint64_t size, uint64_t caps,
+                     uint64_t chunk)
+{
+    uint64_t min = UINT64_MAX, total = 0, tables = 0, t, gpa;
+    uint64_t max_page = EPT_PAGE_SIZE_4K;
+    EPT_PML4_ENTRY *pml4;
+    int reps = 0, ok;
+
+    if ((caps & VMX_EPT_2MB_PAGE_BIT) && chunk >= EPT_PAGE_SIZE_2MB)
+        max_page = EPT_PAGE_SIZE_2MB;
+    if ((caps & VMX_EPT_1GB_PAGE_BIT) && chunk >= EPT_PAGE_SIZE_1GB)
+        max_page = EPT_PAGE_SIZE_1GB;
+
+    do {
+        tables_allocated = 0;
+        t = now_ns();
+        pml4 = user_alloc_table();
+        ok = pml4 != NULL;
+        for (gpa = 0; ok && gpa < size; gpa += chunk)
+            ok = ept_map_range(&user_ops, pml4, gpa, gpa + HPA_OFFSET,
+                               size - gpa < chunk ? size - gpa : chunk, caps,
+                               true);
+        t = now_ns() - t;
+        if (!ok) {
+            fprintf(stderr, "%s: mapping 0x%llx bytes failed\n", name,
+                    (unsigned long long)size);
+            return -1;
+        }
+        tables = tables_allocated;
+        if (t < min)
+            min = t;
+        total += t;
+        reps++;
+        if (total >= MIN_BENCH_NS && check_ept(pml4, size, max_page) < 0)
+            return -1;
+        ept_free_tables(&user_ops, pml4);
+    } while (total < MIN_BENCH_NS);
+
+    report(name, size, tables, min, total, reps);
+    return 0;
+}
+
+/* What the CPU does on a guest access to gpa: set the accessed flag of
+ * every entry on the way to the leaf, and its dirty flag on a write */
+static void touch(EPT_PML4_ENTRY *pml4, uint64_t gpa, int write)
+{
+    EPT_PML4_ENTRY *entry = &pml4[(gpa >> 39) & 0x1ff];
+    int shift;
+
+    for (shift = 30; ; shift -= 9) {
+        ((EPT_PML1_ENTRY *)entry)->Fields.AccessedFlag = 1;
+        if (shift < 12 || (shift < 30 && ((EPT_PML2_2MB_ENTRY *)entry)->Fields.LargePage))
+            break;
+        entry = (EPT_PML4_ENTRY *)user_table_va((uint64_t)entry->Fields.PhysicalAddress << 12) +
+                ((gpa >> shift) & 0x1ff);
+    }
+    if (write)
+        ((EPT_PML1_ENTRY *)entry)->Fields.DirtyFlag = 1;
+}
+
+/* Every page touched, i.e. each stride-th page, and only those, must be
+ * set; every other one of them for the dirty bits. stride 0: none. */
+static int check_bits(const char *what, const uint64_t *map, uint64_t pages,
+                      uint64_t stride, int every)
+{
+    uint64_t page, want;
+
+    for (page = 0; page < pages; page++) {
+        want = stride && page % stride == 0 && (page / stride) % every == 0;
+        if (!!(map[page / 64] & (1ULL << (page % 64))) != want) {
+            fprintf(stderr, "ept-scan: %s bit of page 0x%llx is %d\n", what,
+                    (unsigned long long)page, (int)!want);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int bench_scan(uint64_t size)
+{
+    uint64_t pages = size / EPT_PAGE_SIZE_4K;
+    uint64_t stride = pages / SCAN_TOUCHES, min = UINT64_MAX, total = 0, t, i;
+    uint64_t *accessed = calloc((pages + 63) / 64, 8);
+    uint64_t *dirty = calloc((pages + 63) / 64, 8);
+    struct ept_ad_scan scan = { 0 };
+    EPT_PML4_ENTRY *pml4 = user_alloc_table();
+    int reps = 0, ret = -1;
+
+    tables_allocated = 1;
+    if (!accessed || !dirty || !pml4 || !stride ||
+        !ept_map_range(&user_ops, pml4, 0, HPA_OFFSET, size, 0, true))
+        goto out;
+
+    scan.accessed = accessed;
+    scan.dirty = dirty;
+    scan.pages = pages;
+    scan.clear = true;
+    do {
+        memset(accessed, 0, (pages + 63) / 64 * 8);
+        memset(dirty, 0, (pages + 63) / 64 * 8);
+        for (i = 0; i < SCAN_TOUCHES; i++)
+            touch(pml4, i * stride * EPT_PAGE_SIZE_4K, i % 2 == 0);
+        t = now_ns();
+        ept_scan_ad(&user_ops, pml4, &scan);
+        t = now_ns() - t;
+        if (t < min)
+            min = t;
+        total += t;
+        reps++;
+    } while (total < MIN_BENCH_NS);
+
+    if (check_bits("accessed", accessed, pages, stride, 1) < 0 ||
+        check_bits("dirty", dirty, pages, stride, 2) < 0)
+        goto out;
+    if (scan.tables + scan.tables_skipped > tables_allocated) {
+        fprintf(stderr, "ept-scan: read %llu and skipped %llu of %llu tables\n",
+                (unsigned long long)scan.tables, (unsigned long long)scan.tables_skipped,
+                (unsigned long long)tables_allocated);
+        goto out;
+    }
+    printf("ept-scan  size=%lluM tables=%llu read=%llu reps=%d min=%lluns mean=%lluns\n",
+           (unsigned long long)(size >> 20), (unsigned long long)tables_allocated,
+           (unsigned long long)scan.tables, reps, (unsigned long long)min,
+           (unsigned long long)(total / reps));
+
+    /* everything was cleared, so only pml4 is read now */
+    memset(accessed, 0, (pages + 63) / 64 * 8);
+    ept_scan_ad(&user_ops, pml4, &scan);
+    if (scan.tables != 1 || check_bits("accessed", accessed, pages, 0, 1) < 0) {
+        fprintf(stderr, "ept-scan: flags left after clearing, %llu tables read\n",
+                (unsigned long long)scan.tables);
+        goto out;
+    }
+    ret = 0;
+out:
+    if (ret < 0 && !stride)
+        fprintf(stderr, "ept-scan: 0x%llx bytes is too small\n", (unsigned long long)size);
+    if (pml4)
+        ept_free_tables(&user_ops, pml4);
+    free(accessed);
+    free(dirty);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t max_size = argc > 1 ? strtoull(argv[1], NULL, 0) << 20 : MAX_SIZE;
+    uint64_t both = VMX_EPT_1GB_PAGE_BIT | VMX_EPT_2MB_PAGE_BIT;
+    uint64_t size;
+    uint8_t *ram;
+    int ret = 0;
+
+    if (max_size < MIN_SIZE || max_size > GUEST_MAX_MEM_SIZE) {
+        fprintf(stderr, "usage: %s [max_size_mb (default %llu)]\n", argv[0],
+                (unsigned long long)(MAX_SIZE >> 20));
+        return 1;
+    }
+
+    /* only the page-table area of guest RAM is ever touched */
+    ram = aligned_alloc(4096, GUEST_PAGE_TABLES_END);
+    if (!ram)
+        return 1;
+
+    for (size = MIN_SIZE; size <= max_size && !ret; size *= 2) {
+        if (bench_guest("guest-1g", ram, size, 1) < 0 ||
+            bench_guest("guest-2m", ram, size, 0) < 0 ||
+            bench_ept("ept-1g", size, both, size) < 0 ||
+            bench_ept("ept-2m", size, VMX_EPT_2MB_PAGE_BIT, size) < 0 ||
+            bench_ept("ept-4k", size, 0, size) < 0 ||
+            bench_ept("ept-chunk", size, both, GUEST_CHUNK_SIZE) < 0 ||
+            bench_scan(size) < 0)
+            ret = 1;
+    }
+    free(ram);
+    return ret;
+}